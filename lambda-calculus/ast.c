@@ -28,7 +28,7 @@ Exp* mkvar(Symbol var)
     return result;
 }
 
-Exp* mknum(Symbol num)
+Exp* mknum(long num)
 {
     Exp* result = malloc(sizeof *result);
     result->tag = NUMEXP;
@@ -56,7 +56,7 @@ void print_exp(FILE* out, Exp* exp)
         fprintf(out, "%s", symtext(exp->var));
         break;
     case NUMEXP:
-        fprintf(out, "%s", symtext(exp->num));
+        fprintf(out, "%ld", exp->num);
         break;
     }
 }
@@ -23,14 +23,14 @@ struct Exp {
             Exp* body;
         };
         Symbol var; /* VAREXP */
-        Symbol num; /* NUMEXP */
+        long num; /* NUMEXP */
     };
 };
 
 Exp* mkapp(Exp* left, Exp* right);
 Exp* mklam(Symbol param, Exp* body);
 Exp* mkvar(Symbol var);
-Exp* mknum(Symbol num);
+Exp* mknum(long num);
 
 void print_exp(FILE* out, Exp* exp);
 
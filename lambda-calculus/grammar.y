@@ -19,10 +19,12 @@ int debug_parser = 0;
     Exp*    exp;
     /* Lexer terminals */
     Symbol   id;
+    long     num;
 }
 
 %token LAMBDA VAR NUM
-%type <id> VAR NUM
+%type <id> VAR
+%type <num> NUM
 %type <exp> exp prog
 
 %%
@@ -27,7 +27,7 @@ static LispVal* lisp_var(Symbol var, Env* env)
     result->env = env;
     return result;
 }
-static LispVal* lisp_num(Symbol num, Env* env)
+static LispVal* lisp_num(long num, Env* env)
 {
     LispVal* result = lispval(NUMVAL);
     result->num = num;
@@ -119,7 +119,7 @@ void print_val(FILE* out, LispVal* val)
             fprintf(out, "%s", symtext(val->var));
             break;
         case NUMVAL:
-            fprintf(out, "%s", symtext(val->num));
+            fprintf(out, "%ld", val->num);
             break;
         case ERRVAL:
             fprintf(out, "%s", val->err_msg);
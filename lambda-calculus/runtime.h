@@ -27,7 +27,7 @@ struct LispVal {
             Exp* body;
         };
         Symbol var;
-        Symbol num;
+        long num;
         const char* err_msg;
     };
     Env* env;
@@ -2,19 +2,20 @@
 #include "ast.h"
 #include "runtime.h"
 
-static const char* tag_names[10] = {
-    "LATOM", "LNUM", "LCONS", "LNIL", "LLAM", "LPRIM", "LBOOL", "LERROR", "LCHAR", "LMAC"
+static const char* tag_names[13] = {
+    "LATOM", "LNUM", "LCONS", "LNIL", "LLAM", "LPRIM", "LBOOL", "LERROR", "LCHAR", "LMAC",
+    "LWEAK", "LEPHEMERON", "LTABLE"
 };
 
 const char* lv_tagname(LispVal* value)
 {
-    return tag_names[value->tag];
+    return tag_names[lisp_tag(value)];
 }
 
 static LispVal* lispval(enum LispTag tag)
 {
-    LispVal* result = lisp_alloc(sizeof *result);
-    result->tag = tag;
+    LispVal* result = lisp_alloc(lisp_boxed_size(tag));
+    result->header = LISP_HEADER(tag);
     return result;
 }
 
@@ -25,41 +26,39 @@ LispVal* lisp_atom(Symbol atom)
     return result;
 }
 
-LispVal* lisp_num(int number)
+#ifdef COMPRESSED_REFS
+LispVal* lisp_boxed_num(int number)
 {
     LispVal* result = lispval(LNUM);
     result->number = number;
     return result;
 }
+#endif
 
 LispVal* lisp_cons(LispVal* head, LispVal* tail)
 {
-    LispVal* result = lispval(LCONS);
-    result->head = head;
-    result->tail = tail;
-    return result;
-}
-
-LispVal* lisp_nil()
-{
-    return lispval(LNIL);
+    GC_PROTECT(&head, &tail);
+    struct LispPair* pair = lisp_alloc(sizeof *pair);
+    pair->head = lisp_ref(head);
+    pair->tail = lisp_ref(tail);
+    return (LispVal*)((uintptr_t)pair + LISP_PAIR_BITS);
 }
 
-LispVal* lisp_lam(LispVal* params, LispVal* body, LispVal* closure)
+LispVal* lisp_lam(LispVal* code, LispVal* closure)
 {
+    GC_PROTECT(&code, &closure);
     LispVal* result = lispval(LLAM);
-    result->params = params;
-    result->body = body;
-    result->closure = closure;
+    result->code = lisp_ref(code);
+    result->closure = lisp_ref(closure);
     return result;
 }
 
-LispVal* lisp_macro(LispVal* params, LispVal* body, LispVal* closure)
+LispVal* lisp_macro(LispVal* code, LispVal* closure)
 {
+    GC_PROTECT(&code, &closure);
     LispVal* result = lispval(LMAC);
-    result->params = params;
-    result->body = body;
-    result->closure = closure;
+    result->code = lisp_ref(code);
+    result->closure = lisp_ref(closure);
     return result;
 }
 
@@ -71,48 +70,89 @@ LispVal* lisp_prim(primfunc cfunc)
     return result;
 }
 
-LispVal* lisp_bool(_Bool boolean)
+LispVal* lisp_err(const char* error_msg)
 {
-    LispVal* result = lispval(LBOOL);
-    result->boolean = boolean;
+    LispVal* result = lispval(LERROR);
+    result->error_msg = error_msg;
     return result;
 }
 
-LispVal* lisp_err(const char* error_msg)
+/*
+ * Weak boxes and ephemerons are registered with the collector, which breaks
+ * them when what they refer to is collected
+ */
+LispVal* lisp_weak(LispVal* target)
 {
-    LispVal* result = lispval(LERROR);
-    result->error_msg = error_msg;
+    GC_PROTECT(&target);
+    LispVal* result = lispval(LWEAK);
+    result->target = lisp_ref(target);
+    gc_register_weak(result);
     return result;
 }
 
-LispVal* lisp_char(int character)
+static LispVal* make_ephemeron(LispVal* key, LispVal* value, int old)
 {
-    LispVal* result = lispval(LCHAR);
-    result->character = character;
+    GC_PROTECT(&key, &value);
+    LispVal* result = old ? lisp_alloc_old(lisp_boxed_size(LEPHEMERON))
+        : lisp_alloc(lisp_boxed_size(LEPHEMERON));
+    result->header = LISP_HEADER(LEPHEMERON);
+    result->key = lisp_ref(key);
+    result->value = lisp_ref(value);
+    gc_register_weak(result);
     return result;
 }
 
+LispVal* lisp_ephemeron(LispVal* key, LispVal* value)
+{
+    return make_ephemeron(key, value, 0);
+}
+
+// (for an ephemeron table, see ast.h)
+LispVal* lisp_old_ephemeron(LispVal* key, LispVal* value)
+{
+    return make_ephemeron(key, value, 1);
+}
+
+static void free_table(void* data)
+{
+    LispTable* table = data;
+    free(table->slots);
+    free(table);
+}
+
+LispVal* lisp_table()
+{
+    LispTable* table = calloc(1, sizeof *table);
+    if (!table) {
+        perror("out of memory");
+        abort();
+    }
+    LispVal* result = lispval(LTABLE);
+    result->table = table;
+    gc_add_finalizer(result, free_table, table);
+    return result;
+}
 
 void print_lispval(FILE* out, LispVal* value)
 {
-    switch (value->tag) {
+    switch (lisp_tag(value)) {
         case LATOM:
             fprintf(out, "%s", symtext(value->atom));
             break;
         case LNUM:
-            fprintf(out, "%d", value->number);
+            fprintf(out, "%d", lisp_number(value));
             break;
         case LCONS:
             fputc('(', out);
-            print_lispval(out, value->head);
-            while (value->tail->tag == LCONS) {
+            print_lispval(out, lisp_head(value));
+            while (lisp_tag(lisp_tail(value)) == LCONS) {
                 fputc(' ', out);
-                value = value->tail;
-                print_lispval(out, value->head);
+                value = lisp_tail(value);
+                print_lispval(out, lisp_head(value));
             }
-            if (value->tail->tag != LNIL) {
+            if (lisp_tag(lisp_tail(value)) != LNIL) {
                 fputs(" . ", out);
-                print_lispval(out, value->tail);
+                print_lispval(out, lisp_tail(value));
             }
             fputc(')', out);
             break;
@@ -121,40 +161,51 @@ void print_lispval(FILE* out, LispVal* value)
             break;
         case LLAM:
             fprintf(out, "(lambda ");
-            print_lispval(out, value->params);
-            for (LispVal* e = value->body; e->tag == LCONS; e = e->tail) {
+            print_lispval(out, lisp_params(value));
+            for (LispVal* e = lisp_body(value); lisp_tag(e) == LCONS;
+                    e = lisp_tail(e)) {
                 fputc(' ', out);
-                print_lispval(out, e->head);
+                print_lispval(out, lisp_head(e));
             }
             fputc(')', out);
             break;
         case LMAC:
             fprintf(out, "(macro ");
-            print_lispval(out, value->params);
-            for (LispVal* e = value->body; e->tag == LCONS; e = e->tail) {
+            print_lispval(out, lisp_params(value));
+            for (LispVal* e = lisp_body(value); lisp_tag(e) == LCONS;
+                    e = lisp_tail(e)) {
                 fputc(' ', out);
-                print_lispval(out, e->head);
+                print_lispval(out, lisp_head(e));
             }
             fputc(')', out);
             break;
         case LPRIM:
             fprintf(out, "<primitive>");
             break;
+        case LWEAK:
+            fprintf(out, "<weak-box>");
+            break;
+        case LEPHEMERON:
+            fprintf(out, "<ephemeron>");
+            break;
+        case LTABLE:
+            fprintf(out, "<ephemeron-table>");
+            break;
         case LBOOL:
-            fputs((value->boolean) ? "#t" : "#f", out);
+            fputs((lisp_boolean(value)) ? "#t" : "#f", out);
             break;
         case LERROR:
             fprintf(out, "error: %s", value->error_msg);
             break;
         case LCHAR:
-            if (value->character == ' ') {
+            if (lisp_character(value) == ' ') {
                 fprintf(out, "#\\space");
-            } else if (value->character == '\n') {
+            } else if (lisp_character(value) == '\n') {
                 fprintf(out, "#\\newline");
-            } else if (value->character == '\t') {
+            } else if (lisp_character(value) == '\t') {
                 fprintf(out, "#\\tab");
             } else {
-                fprintf(out, "#\\%c", value->character);
+                fprintf(out, "#\\%c", lisp_character(value));
             }
             break;
     }
@@ -3,56 +3,322 @@
 
 #include "symbol.h"
 #include <stdio.h> // FILE*
+#include <stdint.h>
+#include <stddef.h>
 
 #define DECL_STRUCT(x) struct x; typedef struct x x
 DECL_STRUCT(LispVal );
 DECL_STRUCT(List    );
+DECL_STRUCT(LispTable);
 
 typedef LispVal* (*primfunc)(LispVal* /*args*/);
 
+/*
+ * Built with COMPRESSED_REFS (make compressed), a reference from one heap
+ * object to another is 32 bits, an offset from lisp_heap_base, and so is the
+ * first word of an object. Pairs shrink to 8 bytes, but the heap is limited
+ * to 4GB and numbers that don't fit in 31 bits have to be boxed. Elsewhere,
+ * i.e. in C variables and the roots, references are plain LispVal*.
+ */
+#ifdef COMPRESSED_REFS
+typedef uint32_t LispRef;
+typedef uint32_t LispWord;
+#else
+typedef LispVal* LispRef;
+typedef uintptr_t LispWord;
+#endif
+
+enum LispTag {
+    LATOM,
+    LNUM,
+    LCONS,
+    LNIL,
+    LLAM,
+    LPRIM,
+    LBOOL,
+    LERROR,
+    LCHAR,
+    LMAC,
+    LWEAK,
+    LEPHEMERON,
+    LTABLE,
+};
+#define LISP_LAST_TAG LTABLE
+
+/*
+ * Objects on the heap come in two shapes. Pairs are just their two fields,
+ * 16 bytes (or 8 with COMPRESSED_REFS), and are told apart by how they are
+ * pointed to (see below). Everything else is boxed: a header word giving its
+ * tag, then as many fields as that tag needs.
+ */
+struct LispPair {
+    LispRef head;
+    LispRef tail;
+};
+
 struct LispVal {
-    enum LispTag {
-        LATOM,
-        LNUM,
-        LCONS,
-        LNIL,
-        LLAM,
-        LPRIM,
-        LBOOL,
-        LERROR,
-        LCHAR,
-        LMAC,
-    } tag;
+    LispWord header; // LISP_HEADER(tag)
     union {
         Symbol atom; // LATOM
-        int number; // LNUM
-        struct { // LCONS
-            LispVal* head;
-            LispVal* tail;
-        };
         struct { // LLAM || LMAC
-            LispVal* params;
-            LispVal* body;
-            LispVal* closure;
+            LispRef code; // (params . body)
+            LispRef closure;
         };
         primfunc cfunc; // LPRIM
-        _Bool boolean; // LBOOL
         const char* error_msg; // LERROR
-        int character; // LCHAR
+        LispRef target; // LWEAK, not traced
+        struct { // LEPHEMERON, traced only by the collector (see runtime.c)
+            LispRef key;
+            LispRef value;
+        };
+        LispTable* table; // LTABLE
+#ifdef COMPRESSED_REFS
+        int number; // LNUM, when too big to be immediate
+#endif
     };
 };
 
+/*
+ * Tagged pointers
+ *
+ * Heap objects are 8 byte aligned, so the low bits of a LispVal* say what
+ * it is. Numbers, characters, booleans and () are kept in the LispVal*
+ * itself instead of on the heap:
+ *
+ *     xxx...x000  a boxed object
+ *     xxx...x100  a pair, 4 bytes past its address
+ *     xxx...xxx1  LNUM, the number shifted left one
+ *     xxx...x010  LCHAR, the character shifted left three
+ *     000...0110  #f
+ *     000...1110  #t
+ *     000..10110  ()
+ *
+ * So use lisp_tag(v) rather than v->header, and the accessors below rather
+ * than fields, unless v is known to be boxed.
+ *
+ * A header uses the ...110 pattern too, with values that no LispVal can
+ * have, so the first word of any object says whether it is boxed or a pair.
+ */
+#define LISP_FIXNUM_BIT     1
+#define LISP_CHAR_BITS      2
+#define LISP_CONST_BITS     6
+#define LISP_FALSE          ((LispVal*)(0 << 3 | LISP_CONST_BITS))
+#define LISP_TRUE           ((LispVal*)(1 << 3 | LISP_CONST_BITS))
+#define LISP_NIL            ((LispVal*)(2 << 3 | LISP_CONST_BITS))
+#define LISP_PAIR_BITS      4
+#define LISP_HEADER(tag)    ((LispWord)(16 + (tag)) << 3 | LISP_CONST_BITS)
+#define LISP_HEADER_TAG(h)  (enum LispTag)(((h) >> 3) - 16)
+// Left in the fields of an ephemeron whose key has been collected
+#define LISP_BROKEN         ((LispVal*)(3 << 3 | LISP_CONST_BITS))
+
+static inline int lisp_is_immediate(LispVal* value)
+{
+    return ((uintptr_t)value & 3) != 0;
+}
+
+static inline int lisp_is_pair(LispVal* value)
+{
+    return ((uintptr_t)value & 7) == LISP_PAIR_BITS;
+}
+
+static inline enum LispTag lisp_tag(LispVal* value)
+{
+    uintptr_t bits = (uintptr_t)value;
+    if (bits & LISP_FIXNUM_BIT) {
+        return LNUM;
+    }
+    switch (bits & 7) {
+        case 0: return LISP_HEADER_TAG(value->header);
+        case LISP_PAIR_BITS: return LCONS;
+        case LISP_CHAR_BITS: return LCHAR;
+        default: return (value == LISP_NIL) ? LNIL : LBOOL;
+    }
+}
+
+#ifdef COMPRESSED_REFS
+extern char* lisp_heap_base;
+
+// Immediates keep their bits, truncated; offset 0 is NULL
+static inline LispRef lisp_ref(LispVal* value)
+{
+    if (lisp_is_immediate(value) || !value) {
+        return (LispRef)(uintptr_t)value;
+    }
+    return (LispRef)((char*)value - lisp_heap_base);
+}
+
+static inline LispVal* lisp_deref(LispRef ref)
+{
+    if ((ref & 3) || !ref) {
+        return (LispVal*)(intptr_t)(int32_t)ref;
+    }
+    return (LispVal*)(lisp_heap_base + ref);
+}
+#else
+static inline LispRef lisp_ref(LispVal* value)
+{
+    return value;
+}
+
+static inline LispVal* lisp_deref(LispRef ref)
+{
+    return ref;
+}
+#endif
+
+// How many bytes a boxed object with this tag takes
+static inline size_t lisp_boxed_size(enum LispTag tag)
+{
+    return (tag == LLAM || tag == LMAC || tag == LEPHEMERON)
+        ? sizeof(LispVal) : 2 * sizeof(void*);
+}
+
+static inline struct LispPair* lisp_pair(LispVal* value)
+{
+    return (struct LispPair*)((uintptr_t)value - LISP_PAIR_BITS);
+}
+
+static inline LispVal* lisp_head(LispVal* value)
+{
+    return lisp_deref(lisp_pair(value)->head);
+}
+
+static inline LispVal* lisp_tail(LispVal* value)
+{
+    return lisp_deref(lisp_pair(value)->tail);
+}
+
+static inline void lisp_set_head(LispVal* pair, LispVal* head)
+{
+    lisp_pair(pair)->head = lisp_ref(head);
+}
+
+static inline void lisp_set_tail(LispVal* pair, LispVal* tail)
+{
+    lisp_pair(pair)->tail = lisp_ref(tail);
+}
+
+// The second, third and fourth elements of a list, and the rest after two
+static inline LispVal* lisp_cadr(LispVal* value)
+{
+    return lisp_head(lisp_tail(value));
+}
+
+static inline LispVal* lisp_cddr(LispVal* value)
+{
+    return lisp_tail(lisp_tail(value));
+}
+
+static inline LispVal* lisp_caddr(LispVal* value)
+{
+    return lisp_head(lisp_cddr(value));
+}
+
+static inline LispVal* lisp_cadddr(LispVal* value)
+{
+    return lisp_head(lisp_tail(lisp_cddr(value)));
+}
+
+// of an LLAM or LMAC
+static inline LispVal* lisp_params(LispVal* value)
+{
+    return lisp_head(lisp_deref(value->code));
+}
+
+static inline LispVal* lisp_body(LispVal* value)
+{
+    return lisp_tail(lisp_deref(value->code));
+}
+
+static inline LispVal* lisp_closure(LispVal* value)
+{
+    return lisp_deref(value->closure);
+}
+
+// of an LEPHEMERON
+static inline int lisp_ephemeron_broken(LispVal* value)
+{
+    return lisp_deref(value->key) == LISP_BROKEN;
+}
+
+/*
+ * An ephemeron table keeps its entries off the heap, in an open addressing
+ * hash table of ephemerons. The ephemerons are made in the old generation,
+ * so only major collections need look at them. Keys that are only eqv? to
+ * themselves are hashed by address, so they have to be hashed again after a
+ * collection that may have moved them (see evaluator.c). The table is freed
+ * along with the LTABLE.
+ */
+struct LispTable {
+    LispVal** slots; // NULL where free
+    size_t size; // a power of 2, or 0 when there are no slots yet
+    size_t count; // slots in use, including ephemerons that have broken
+    size_t by_address; // keys hashed by address
+    size_t young; // of those, the ones in the nursery
+    long long hashed_at; // gc_moves(young > 0) when they were hashed
+};
+
+#ifdef COMPRESSED_REFS
+LispVal* lisp_boxed_num(int number);
+#define LISP_FIXNUM_MAX     ((1 << 30) - 1)
+#define LISP_FIXNUM_MIN     (-(1 << 30))
+#endif
+
+static inline LispVal* lisp_num(int number)
+{
+#ifdef COMPRESSED_REFS
+    if (number > LISP_FIXNUM_MAX || number < LISP_FIXNUM_MIN) {
+        return lisp_boxed_num(number);
+    }
+#endif
+    return (LispVal*)(((uintptr_t)(intptr_t)number << 1) | LISP_FIXNUM_BIT);
+}
+
+static inline int lisp_number(LispVal* value)
+{
+#ifdef COMPRESSED_REFS
+    if (!lisp_is_immediate(value)) {
+        return value->number;
+    }
+#endif
+    return (intptr_t)value >> 1;
+}
+
+static inline LispVal* lisp_char(int character)
+{
+    return (LispVal*)(((uintptr_t)(intptr_t)character << 3) | LISP_CHAR_BITS);
+}
+
+static inline int lisp_character(LispVal* value)
+{
+    return (intptr_t)value >> 3;
+}
+
+static inline LispVal* lisp_bool(_Bool boolean)
+{
+    return boolean ? LISP_TRUE : LISP_FALSE;
+}
+
+static inline _Bool lisp_boolean(LispVal* value)
+{
+    return value == LISP_TRUE;
+}
+
+static inline LispVal* lisp_nil()
+{
+    return LISP_NIL;
+}
 
 LispVal* lisp_atom(Symbol atom);
-LispVal* lisp_num(int number);
 LispVal* lisp_cons(LispVal* head, LispVal* tail);
-LispVal* lisp_nil();
-LispVal* lisp_lam(LispVal* params, LispVal* body, LispVal* closure);
-LispVal* lisp_macro(LispVal* params, LispVal* body, LispVal* closure);
+LispVal* lisp_lam(LispVal* code, LispVal* closure);
+LispVal* lisp_macro(LispVal* code, LispVal* closure);
 LispVal* lisp_prim(primfunc cfunc);
-LispVal* lisp_bool(_Bool boolean);
 LispVal* lisp_err(const char* error_msg);
-LispVal* lisp_char(int character);
+LispVal* lisp_weak(LispVal* target);
+LispVal* lisp_ephemeron(LispVal* key, LispVal* value);
+LispVal* lisp_old_ephemeron(LispVal* key, LispVal* value);
+LispVal* lisp_table();
 
 void print_lispval(FILE* out, LispVal* value);
 
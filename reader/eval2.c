@@ -1,5 +1,8 @@
 #include "eval2.h"
+#include "runtime.h"
+#include "profile.h"
 #include <stdlib.h>
+#include <stdint.h>
 
 // define routine values such that they cannot be memory addresses
 // i.e. not aligned
@@ -35,6 +38,7 @@
 #define EV_SEQUENCE_LAST_EXP        ROUTINE(27LL)
 #define REVERSE_ARGS                ROUTINE(28LL)
 
+#define SYNTAX_ERROR                ROUTINE(96LL)
 #define INCORRECT_NUM_ARGS          ROUTINE(97LL)
 #define UNKNOWN_EXPR_ERROR          ROUTINE(98LL)
 #define UNKNOWN_PROC_TYPE_ERROR     ROUTINE(99LL)
@@ -106,8 +110,8 @@ static void restore_location(long long* ploc)
 
 static _Bool good_list(LispVal* list)
 {
-    for (; list->tag != LNIL; list = list->tail)
-        if (list->tag != LCONS)
+    for (; lisp_tag(list) != LNIL; list = lisp_tail(list))
+        if (lisp_tag(list) != LCONS)
             return 0;
     return 1;
 }
@@ -115,7 +119,7 @@ static _Bool good_list(LispVal* list)
 static int list_length(LispVal* list)
 {
     int result = 0;
-    for (; list->tag != LNIL; list = list->tail)
+    for (; lisp_tag(list) != LNIL; list = lisp_tail(list))
         result++;
     return result;
 }
@@ -123,7 +127,7 @@ static int list_length(LispVal* list)
 
 static _Bool is_self_evaluating(LispVal* expr)
 {
-    switch (expr->tag) {
+    switch (lisp_tag(expr)) {
         case LNUM:
         case LNIL:
         case LLAM:
@@ -132,6 +136,9 @@ static _Bool is_self_evaluating(LispVal* expr)
         case LERROR:
         case LCHAR:
         case LMAC:
+        case LWEAK:
+        case LEPHEMERON:
+        case LTABLE:
             return 1;
         case LATOM:
         case LCONS:
@@ -141,74 +148,227 @@ static _Bool is_self_evaluating(LispVal* expr)
 
 static _Bool is_variable(LispVal* expr)
 {
-    return expr->tag == LATOM;
+    return lisp_tag(expr) == LATOM;
 }
 
-static _Bool is_form(LispVal* expr, const char* formname)
+static Symbol quote_symbol;
+static Symbol assignment_symbol;
+static Symbol define_symbol;
+static Symbol if_symbol;
+static Symbol lambda_symbol;
+static Symbol begin_symbol;
+
+static _Bool is_form(LispVal* expr, Symbol form)
 {
-    return expr->tag == LCONS
-        && expr->head->tag == LATOM
-        && sym_equal(expr->head->atom, sym(formname));
+    return lisp_tag(expr) == LCONS
+        && lisp_tag(lisp_head(expr)) == LATOM
+        && sym_equal(lisp_head(expr)->atom, form);
 }
 
 static _Bool is_quoted(LispVal* expr)
 {
-    return is_form(expr, "quote");
+    return is_form(expr, quote_symbol);
 }
 
 static _Bool is_assignment(LispVal* expr)
 {
-    return is_form(expr, "set!");
+    return is_form(expr, assignment_symbol);
 }
 
 static _Bool is_definition(LispVal* expr)
 {
-    return is_form(expr, "define");
+    return is_form(expr, define_symbol);
 }
 
 static _Bool is_if(LispVal* expr)
 {
-    return is_form(expr, "if");
+    return is_form(expr, if_symbol);
 }
 
 static _Bool is_lambda(LispVal* expr)
 {
-    return is_form(expr, "lambda");
+    return is_form(expr, lambda_symbol);
 }
 
 static _Bool is_begin(LispVal* expr)
 {
-    return is_form(expr, "begin");
+    return is_form(expr, begin_symbol);
 }
 
 static _Bool is_application(LispVal* expr)
 {
-    return expr->tag == LCONS   // we actually can't know until we evaluate
+    return lisp_tag(expr) == LCONS // we actually can't know until we evaluate
                                 // the head
-        && good_list(expr->tail);
+        && good_list(lisp_tail(expr));
+}
+
+/*
+ * What EVAL_DISPATCH makes of a combination: the routine to go to, and the
+ * parts of the expression that routine starts with, or the error to give
+ * if it's badly formed.
+ */
+struct Syntax {
+    LispVal* expr; // NULL while the entry is free
+    long long routine;
+    const char* error; // for SYNTAX_ERROR
+    LispVal* operands[2];
+};
+
+static void classify(LispVal* expr, struct Syntax* syntax)
+{
+    syntax->expr = expr;
+    syntax->error = NULL;
+    syntax->operands[0] = syntax->operands[1] = NULL;
+    syntax->routine = SYNTAX_ERROR;
+    if (is_quoted(expr)) {
+        // (quote <datum>)
+        if (!good_list(expr)) {
+            syntax->error = "bad special form: quote";
+        } else if (list_length(expr) != 2) {
+            syntax->error = "wrong number of args to special form: quote";
+        } else {
+            syntax->routine = EV_QUOTED;
+            syntax->operands[0] = lisp_cadr(expr);
+        }
+    } else if (is_assignment(expr)) {
+        syntax->routine = EV_ASSIGNMENT;
+    } else if (is_definition(expr)) {
+        // (define <variable> <expression>)
+        if (!good_list(expr) || list_length(expr) != 3) {
+            syntax->error = "bad special form: define";
+        } else {
+            syntax->routine = EV_DEFINITION;
+            syntax->operands[0] = lisp_cadr(expr);
+            syntax->operands[1] = lisp_caddr(expr);
+        }
+    } else if (is_if(expr)) {
+        // (if <test> <consequent> <alternate>)
+        if (!(good_list(expr) && list_length(expr) == 4)) {
+            syntax->error = "incorrect syntax for if";
+        } else {
+            syntax->routine = EV_IF;
+            syntax->operands[0] = lisp_cadr(expr);
+        }
+    } else if (is_lambda(expr)) {
+        // (lambda (params ...) body ...)
+        if (!good_list(expr) || list_length(expr) < 3) {
+            syntax->error = "bad special form: lambda";
+        } else if (!good_list(lisp_cadr(expr))) {
+            syntax->error = "bad special form: params must be a list";
+        } else {
+            syntax->routine = EV_LAMBDA;
+            syntax->operands[0] = lisp_tail(expr); // (params . body)
+        }
+    } else if (is_begin(expr)) {
+        // (begin <action> ...)
+        if (!good_list(expr) || list_length(expr) < 2) {
+            syntax->error = "bad special form: begin";
+        } else {
+            syntax->routine = EV_BEGIN;
+            syntax->operands[0] = lisp_tail(expr);
+        }
+    } else if (is_application(expr)) {
+        syntax->routine = EV_APPLICATION;
+        syntax->operands[0] = lisp_head(expr);
+        syntax->operands[1] = lisp_tail(expr);
+    } else {
+        syntax->routine = UNKNOWN_EXPR_ERROR;
+    }
+}
+
+/*
+ * The code of the program's procedures is in the immortal space, where it
+ * never moves, so each combination there is classified the first time it's
+ * evaluated and looked up by address after that. Anything else is classified
+ * every time, into uncached, whose operands are roots.
+ */
+static struct Syntax* syntax_cache; // open addressing
+static size_t syntax_cache_size;
+static size_t syntax_cache_count;
+static struct Syntax uncached;
+
+// Where the routine that EVAL_DISPATCH just chose finds its operands
+static struct Syntax* syntax;
+
+static _Bool is_fixed(LispVal* value)
+{
+    return !value || lisp_is_immediate(value) || gc_is_immortal(value);
+}
+
+static size_t hash_expr(LispVal* expr)
+{
+    return ((uintptr_t)expr >> 3) * 0x9e3779b97f4a7c15ULL;
+}
+
+static void grow_syntax_cache()
+{
+    size_t new_size = syntax_cache_size ? 2 * syntax_cache_size : 1024;
+    struct Syntax* new_cache = calloc(new_size, sizeof *new_cache);
+    if (!new_cache) { perror("out of memory"); abort(); }
+    for (size_t i = 0; i < syntax_cache_size; i++) {
+        if (!syntax_cache[i].expr) {
+            continue;
+        }
+        size_t h = hash_expr(syntax_cache[i].expr) & (new_size - 1);
+        while (new_cache[h].expr) {
+            h = (h + 1) & (new_size - 1);
+        }
+        new_cache[h] = syntax_cache[i];
+    }
+    free(syntax_cache);
+    syntax_cache = new_cache;
+    syntax_cache_size = new_size;
+}
+
+static struct Syntax* syntax_of(LispVal* expr)
+{
+    if (!gc_is_immortal(expr)) {
+        classify(expr, &uncached);
+        return &uncached;
+    }
+    if (2 * (syntax_cache_count + 1) > syntax_cache_size) {
+        grow_syntax_cache();
+    }
+    size_t h = hash_expr(expr) & (syntax_cache_size - 1);
+    for (; syntax_cache[h].expr; h = (h + 1) & (syntax_cache_size - 1)) {
+        if (syntax_cache[h].expr == expr) {
+            return &syntax_cache[h];
+        }
+    }
+    classify(expr, &syntax_cache[h]);
+    // (an immortal pair can still point into the heap, if the immortal
+    // space filled up while it was being copied there)
+    if (!is_fixed(syntax_cache[h].operands[0])
+            || !is_fixed(syntax_cache[h].operands[1])) {
+        uncached = syntax_cache[h];
+        syntax_cache[h].expr = NULL;
+        return &uncached;
+    }
+    syntax_cache_count++;
+    return &syntax_cache[h];
 }
 
 static _Bool is_primitive_proc(LispVal* expr)
 {
-    return expr->tag == LPRIM;
+    return lisp_tag(expr) == LPRIM;
 }
 
 static _Bool is_compound_proc(LispVal* expr)
 {
-    return expr->tag == LLAM;
+    return lisp_tag(expr) == LLAM;
 }
 
 static _Bool is_nil(LispVal* expr)
 {
-    return expr->tag == LNIL;
+    return lisp_tag(expr) == LNIL;
 }
 
 static LispVal* lookup_variable_value(LispVal* expr)
 {
-    for (LispVal* e = env2; e->tag != LNIL; e = e->tail) {
-        LispVal* nvp = e->head; // (name . value)
-        if (sym_equal(expr->atom, nvp->head->atom)) {
-            return nvp->tail;
+    for (LispVal* e = env2; lisp_tag(e) != LNIL; e = lisp_tail(e)) {
+        LispVal* nvp = lisp_head(e); // (name . value)
+        if (sym_equal(expr->atom, lisp_head(nvp)->atom)) {
+            return lisp_tail(nvp);
         }
     }
     // what if it's not found
@@ -217,7 +377,7 @@ static LispVal* lookup_variable_value(LispVal* expr)
 
 static _Bool is_last_operand(LispVal* expr)
 {
-    return expr->tag == LCONS && expr->tail->tag == LNIL;
+    return lisp_tag(expr) == LCONS && lisp_tag(lisp_tail(expr)) == LNIL;
 }
 
 static LispVal* apply_primitive_proc(LispVal* fn, LispVal* args)
@@ -228,7 +388,7 @@ static LispVal* apply_primitive_proc(LispVal* fn, LispVal* args)
 
 static _Bool is_truthy(LispVal* expr)
 {
-    return expr->tag != LBOOL || !expr->boolean;
+    return lisp_tag(expr) != LBOOL || lisp_boolean(expr);
 }
 
 static void print_reg(const char* regname, LispVal* reg)
@@ -283,6 +443,11 @@ static void print_routine(const char* regname, long long routine)
 static void eval2_main_loop()
 {
     for (;;) {
+        // All of the machine's state is in its registers and stack, which the
+        // collector knows about, so between instructions is a safe place to
+        // collect
+        mark_safepoint();
+
         // if we are debugging we could print out the state of the registers
         if (debug_eval2) {
             print_routine("pc", pc);
@@ -303,49 +468,9 @@ static void eval2_main_loop()
                     pc = EV_SELF_EVAL;
                 } else if (is_variable(expr2)) {
                     pc = EV_VARIABLE;
-                } else if (is_quoted(expr2)) {
-                    if (!good_list(expr2)) {
-                        val2 = lisp_err("bad special form: quote");
-                        pc = continue2;
-                    } else if (list_length(expr2) != 2){
-                        val2 = lisp_err("wrong number of args to special form: quote");
-                        pc = continue2;
-                    } else {
-                        pc = EV_QUOTED;
-                    }
-                } else if (is_assignment(expr2)) {
-                    pc = EV_ASSIGNMENT;
-                } else if (is_definition(expr2)) {
-                    if (!good_list(expr2) || list_length(expr2) != 3) {
-                        val2 = lisp_err("bad special form: define");
-                        pc = continue2;
-                    } else {
-                        pc = EV_DEFINITION;
-                    }
-                } else if (is_if(expr2)) {
-                    if (!(good_list(expr2) && list_length(expr2) == 4)) {
-                        val2 = lisp_err("incorrect syntax for if");
-                        pc = continue2;
-                    } else {
-                        pc = EV_IF;
-                    }
-                } else if (is_lambda(expr2)) {
-                    if (!good_list(expr2) || list_length(expr2) < 3) {
-                        val2 = lisp_err("bad special form: lambda");
-                        pc = continue2;
-                    } else {
-                        pc = EV_LAMBDA;
-                    }
-                } else if (is_begin(expr2)) {
-                    if (!good_list(expr2) || list_length(expr2) >= 2) {
-                        val2 = lisp_err("bad special form: begin");
-                        pc = continue2;
-                    }
-                    pc = EV_BEGIN;
-                } else if (is_application(expr2)) {
-                    pc = EV_APPLICATION;
                 } else {
-                    pc = UNKNOWN_EXPR_ERROR;
+                    syntax = syntax_of(expr2);
+                    pc = syntax->routine;
                 }
                 break;
             case APPLY_DISPATCH:
@@ -373,14 +498,14 @@ static void eval2_main_loop()
                 break;
             case EV_QUOTED:
                 // (quote quoted-expr)
-                val2 = expr2->tail->head; // text-of-quotation
+                val2 = syntax->operands[0]; // text-of-quotation
                 pc = continue2;
                 break;
             case EV_DEFINITION:
                 // (define <variable> <expression>)
-                unev2 = expr2->tail->head; // definition-variable
+                unev2 = syntax->operands[0]; // definition-variable
                 save(unev2);
-                expr2 = expr2->tail->tail->head; // definition-expression
+                expr2 = syntax->operands[1]; // definition-expression
                 save(env2);
                 save(continue2);
                 continue2 = EV_DEFINITION_1;
@@ -391,6 +516,9 @@ static void eval2_main_loop()
                 restore(&env2);
                 restore(&unev2);
                 // begin: define-variable!
+                // (this only conses onto the front of env2 and never stores
+                // into an existing pair, so there is no need for a
+                // gc_write_barrier here)
                 unev2 = lisp_cons(unev2, val2);
                 if (env2 == global_env) {
                     global_env = env2 = lisp_cons(unev2, env2);
@@ -406,7 +534,7 @@ static void eval2_main_loop()
                 save(env2);
                 save(continue2);
                 continue2 = EV_IF_DECIDE;
-                expr2 = expr2->tail->head; // if-predicate
+                expr2 = syntax->operands[0]; // if-predicate
                 pc = EVAL_DISPATCH;
                 break;
             case EV_IF_DECIDE:
@@ -421,27 +549,25 @@ static void eval2_main_loop()
                                          debugger we will create */
                 break;
             case EV_IF_ALTERNATE:
-                expr2 = expr2->tail->tail->tail->head; // if-alternate
+                expr2 = lisp_cadddr(expr2); // if-alternate
                 pc = EVAL_DISPATCH;
                 break;
             case EV_IF_CONSEQUENT:
-                expr2 = expr2->tail->tail->head; // if-consequent
+                expr2 = lisp_caddr(expr2); // if-consequent
                 pc = EVAL_DISPATCH;
                 break;
             case EV_LAMBDA:
                 // (lambda (params ...) body ...)
-                unev2 = expr2->tail->head; // lambda-parameters
-                expr2 = expr2->tail->tail; // lambda-body
-                if (!good_list(unev2)) {
-                    val2 = lisp_err("bad special form: params must be a list");
-                } else {
-                    val2 = lisp_lam(unev2, expr2, env2); // make-procedure
-                }
+                // (params . body) is shared with the lambda expression
+                val2 = lisp_lam(syntax->operands[0], env2); // make-procedure
                 pc = continue2;
                 break;
             case EV_APPLICATION:
-                unev2 = expr2->tail; // operands
-                expr2 = expr2->head; // operator
+                // the application is in progress for as long as the
+                // continue2 saved here is on the stack
+                profile_enter(profile_site(syntax->operands[0]), sp - stack2);
+                unev2 = syntax->operands[1]; // operands
+                expr2 = syntax->operands[0]; // operator
                 save(continue2);
                 save(env2);
                 save(unev2);
@@ -451,7 +577,7 @@ static void eval2_main_loop()
             case EVAL_ARGS:
                 restore(&unev2);
                 restore(&env2);
-                argl2 = lisp_nil(); // Want to make this not allocate...
+                argl2 = lisp_nil();
                 fun2 = val2;
                 if (is_nil(unev2)) {
                     pc = APPLY_DISPATCH;
@@ -463,7 +589,7 @@ static void eval2_main_loop()
                 break;
             case EVAL_ARG_LOOP:
                 save(argl2);
-                expr2 = unev2->head;
+                expr2 = lisp_head(unev2);
                 if (is_last_operand(unev2)) {
                     pc = EVAL_LAST_ARG;
                     break;
@@ -478,7 +604,7 @@ static void eval2_main_loop()
                 restore(&env2);
                 restore(&argl2);
                 argl2 = lisp_cons(val2, argl2);
-                unev2 = unev2->tail;
+                unev2 = lisp_tail(unev2);
                 pc = EVAL_ARG_LOOP;
                 break;
             case EVAL_LAST_ARG:
@@ -496,8 +622,8 @@ static void eval2_main_loop()
                 break;
             case REVERSE_ARGS: /* we can use a do-while loop since we have at
                                   least 1 arg */
-                unev2 = lisp_cons(argl2->head, unev2);
-                argl2 = argl2->tail;
+                unev2 = lisp_cons(lisp_head(argl2), unev2);
+                argl2 = lisp_tail(argl2);
                 if (!is_nil(argl2)) {
                     pc = REVERSE_ARGS;
                     break;
@@ -508,11 +634,12 @@ static void eval2_main_loop()
             case PRIMITIVE_APPLY:
                 val2 = apply_primitive_proc(fun2, argl2); // apply-primitive-proc
                 restore(&continue2);
+                profile_leave(sp - stack2);
                 pc = continue2;
                 break;
             case COMPOUND_APPLY:
-                unev2 = fun2->params; // procedure-parameters
-                env2 = fun2->closure; // procedure-environment
+                unev2 = lisp_params(fun2); // procedure-parameters
+                env2 = lisp_closure(fun2); // procedure-environment
                 pc = EXTEND_ENV_LOOP;
                 break;
             case EXTEND_ENV_LOOP:
@@ -526,18 +653,18 @@ static void eval2_main_loop()
                 }
                 // we can overwrite expr2 since it gets overwritten in
                 // EV_SEQUENCE anyway
-                expr2 = lisp_cons(unev2->head, argl2->head);
+                expr2 = lisp_cons(lisp_head(unev2), lisp_head(argl2));
                 env2 = lisp_cons(expr2, env2);
-                unev2 = unev2->tail;
-                argl2 = argl2->tail;
+                unev2 = lisp_tail(unev2);
+                argl2 = lisp_tail(argl2);
                 pc = EXTEND_ENV_LOOP; // already is this but make explicit
                 break;
             case COMPOUND_APPLY_CONT:
-                unev2 = fun2->body; // procedure-body
+                unev2 = lisp_body(fun2); // procedure-body
                 pc = EV_SEQUENCE;
                 break;
             case EV_SEQUENCE:
-                expr2 = unev2->head; // first-exp
+                expr2 = lisp_head(unev2); // first-exp
                 if (is_last_operand(unev2)) {
                     pc = EV_SEQUENCE_LAST_EXP;
                     break;
@@ -550,19 +677,24 @@ static void eval2_main_loop()
             case EV_SEQUENCE_CONT:
                 restore(&env2);
                 restore(&unev2);
-                unev2 = unev2->tail; // rest-exps
+                unev2 = lisp_tail(unev2); // rest-exps
                 pc = EV_SEQUENCE;
                 break;
             case EV_SEQUENCE_LAST_EXP:
                 restore(&continue2);
+                profile_leave(sp - stack2);
                 pc = EVAL_DISPATCH;
                 break;
             case EV_BEGIN:
                 // (begin <action> ...)
-                unev2 = expr2->tail; // begin-actions
+                unev2 = syntax->operands[0]; // begin-actions
                 save(continue2);
                 pc = EV_SEQUENCE;
                 break;
+            case SYNTAX_ERROR:
+                val2 = lisp_err(syntax->error);
+                pc = continue2;
+                break;
             case INCORRECT_NUM_ARGS:
                 fprintf(stderr, "error: applying function ");
                 print_lispval(stderr, fun2);
@@ -600,6 +732,7 @@ LispVal* eval2(LispVal* expr)
     expr2 = expr;
     env2 = global_env;
     sp = stack2;
+    profile_leave(0);
     eval2_main_loop();
     // The result must now be in val2
     return val2;
@@ -618,22 +751,73 @@ LispVal* prim_plus(LispVal* args);
 LispVal* prim_multiply(LispVal* args);
 LispVal* prim_subtract(LispVal* args);
 LispVal* prim_eqv(LispVal* args);
+LispVal* prim_cons(LispVal* args);
+LispVal* prim_car(LispVal* args);
+LispVal* prim_cdr(LispVal* args);
+LispVal* prim_gc_stats(LispVal* args);
+LispVal* prim_make_weak_box(LispVal* args);
+LispVal* prim_weak_box_value(LispVal* args);
+LispVal* prim_make_ephemeron(LispVal* args);
+LispVal* prim_ephemeron_key(LispVal* args);
+LispVal* prim_ephemeron_value(LispVal* args);
+LispVal* prim_make_ephemeron_table(LispVal* args);
+LispVal* prim_ephemeron_table_ref(LispVal* args);
+LispVal* prim_ephemeron_table_set(LispVal* args);
+LispVal* prim_register_finalizer(LispVal* args);
 
 void initialize_evaluator2()
 {
+    gc_add_root(&global_env);
+    gc_add_root(&expr2);
+    gc_add_root(&env2);
+    gc_add_root(&fun2);
+    gc_add_root(&argl2);
+    gc_add_root(&val2);
+    gc_add_root(&unev2);
+    gc_add_root(&uncached.operands[0]);
+    gc_add_root(&uncached.operands[1]);
+    /*
+     * Only the used part of stack2 is live. Saved routines are never aligned,
+     * so the collector can't mistake them for heap pointers.
+     */
+    _Static_assert(sizeof(StackVal) == sizeof(LispVal*),
+            "stack2 must be scannable as an array of LispVal*");
+    gc_add_root_stack((LispVal**)stack2, (LispVal***)&sp);
+
+    quote_symbol = sym_permanent("quote");
+    assignment_symbol = sym_permanent("set!");
+    define_symbol = sym_permanent("define");
+    if_symbol = sym_permanent("if");
+    lambda_symbol = sym_permanent("lambda");
+    begin_symbol = sym_permanent("begin");
+
     // set registers to nil
     env2 = lisp_nil();
     argl2 = env2;
     val2 = env2;
     expr2 = env2;
 
-    // Add primitive ops to the environment
-
+    // Add primitive ops to the environment. They are never collected.
+    gc_set_immortal(1);
     add_prim("eqv?", prim_eqv);
     add_prim("eq?", prim_eqv);
     add_prim("+", prim_plus);
     add_prim("*", prim_multiply);
     add_prim("-", prim_subtract);
+    add_prim("cons", prim_cons);
+    add_prim("car", prim_car);
+    add_prim("cdr", prim_cdr);
+    add_prim("gc-stats", prim_gc_stats);
+    add_prim("make-weak-box", prim_make_weak_box);
+    add_prim("weak-box-value", prim_weak_box_value);
+    add_prim("make-ephemeron", prim_make_ephemeron);
+    add_prim("ephemeron-key", prim_ephemeron_key);
+    add_prim("ephemeron-value", prim_ephemeron_value);
+    add_prim("make-ephemeron-table", prim_make_ephemeron_table);
+    add_prim("ephemeron-table-ref", prim_ephemeron_table_ref);
+    add_prim("ephemeron-table-set!", prim_ephemeron_table_set);
+    add_prim("register-finalizer!", prim_register_finalizer);
+    gc_set_immortal(0);
     unev2 = val2 = argl2 = expr2; // Should still be nil
     global_env = env2;
 }
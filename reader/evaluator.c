@@ -1,52 +1,78 @@
 #include "evaluator.h"
+#include "runtime.h"
+#include "profile.h"
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 
 int debug_evaluator = 0;
 
 LispVal* env; // Global environment
 
+static size_t call_depth; // of applications in progress, for the profiler
+
 static LispVal* eval_with_env(LispVal* expr, LispVal* env);
 static LispVal* eval_quasi(LispVal* template, LispVal* env, int quote_level);
 
 static LispVal* eval_body(LispVal* expressions, LispVal* env)
 {
     // Assume good list length > 1
+    // (result isn't a root: only the last value is wanted, and keeping the
+    // earlier ones alive while the rest run would be a leak)
     LispVal* result = lisp_nil(); // just in case
-    for (LispVal* e = expressions; e->tag == LCONS; e = e->tail) {
-        result =  eval_with_env(e->head, env);
+    LispVal* e = expressions;
+    GC_PROTECT(&env, &e);
+    for (; lisp_tag(e) == LCONS; e = lisp_tail(e)) {
+        result =  eval_with_env(lisp_head(e), env);
     }
     return result;
 }
 
+/*
+ * The environment of *fn with its parameters bound to args. Only *fn is
+ * left rooted by the caller, so none of this is kept alive while the body
+ * runs.
+ */
+static LispVal* bind_args(LispVal** fn, LispVal* args)
+{
+    LispVal* env_w_bound_args = lisp_closure(*fn);
+    LispVal* p = lisp_params(*fn);
+    LispVal* a = args;
+    LispVal* binding = NULL;
+    GC_PROTECT(fn, &env_w_bound_args, &p, &a, &binding);
+    if (debug_evaluator) {
+        fprintf(stderr, "env before: ");
+        print_lispval(stderr, env_w_bound_args);
+        fputs("\n", stderr);
+    }
+    for (; lisp_tag(p) == LCONS || lisp_tag(a) == LCONS;
+            p = lisp_tail(p), a = lisp_tail(a)) {
+        if (lisp_tag(p) != LCONS || lisp_tag(a) != LCONS) {
+            return lisp_err("incorrect number of arguments "
+                    "for call to lambda");
+        }
+        binding = lisp_cons(lisp_head(p), lisp_head(a));
+        env_w_bound_args = lisp_cons(binding, env_w_bound_args);
+    }
+    if (debug_evaluator) {
+        fprintf(stderr, "after binding args: ");
+        print_lispval(stderr, env_w_bound_args);
+        fputs("\n", stderr);
+    }
+    return env_w_bound_args;
+}
+
 static LispVal* apply(LispVal* fn, LispVal* args)
 {
-    if (fn->tag == LLAM || fn->tag == LMAC) {
+    if (lisp_tag(fn) == LLAM || lisp_tag(fn) == LMAC) {
         // bind args to fn environment
-        LispVal* env_w_bound_args = fn->closure;
-        if (debug_evaluator) {
-            fprintf(stderr, "env before: ");
-            print_lispval(stderr, env_w_bound_args);
-            fputs("\n", stderr);
-        }
-        for (LispVal* p = fn->params, * a = args;
-                p->tag == LCONS || a->tag == LCONS;
-                p = p->tail, a = a->tail) {
-            if (p->tag != LCONS || a->tag != LCONS) {
-                return lisp_err("incorrect number of arguments "
-                        "for call to lambda");
-            }
-            env_w_bound_args =
-                lisp_cons(lisp_cons(p->head, a->head), env_w_bound_args);
-        }
-        if (debug_evaluator) {
-            fprintf(stderr, "after binding args: ");
-            print_lispval(stderr, env_w_bound_args);
-            fputs("\n", stderr);
+        LispVal* env_w_bound_args = bind_args(&fn, args);
+        if (lisp_tag(env_w_bound_args) == LERROR) {
+            return env_w_bound_args;
         }
         // eval body
-        return eval_body(fn->body, env_w_bound_args);
-    } else if (fn->tag == LPRIM) {
+        return eval_body(lisp_body(fn), env_w_bound_args);
+    } else if (lisp_tag(fn) == LPRIM) {
         return fn->cfunc(args);
     } else {
         // TODO: return error
@@ -59,12 +85,14 @@ static LispVal* apply(LispVal* fn, LispVal* args)
 
 static LispVal* eval_each(LispVal* list, LispVal* env)
 {
-    if (list->tag == LNIL) {
+    if (lisp_tag(list) == LNIL) {
         return list;
-    } else if (list->tag == LCONS) {
-        return lisp_cons(
-                eval_with_env(list->head, env),
-                eval_each(list->tail, env));
+    } else if (lisp_tag(list) == LCONS) {
+        LispVal* head = NULL;
+        GC_PROTECT(&list, &env, &head);
+        head = eval_with_env(lisp_head(list), env);
+        LispVal* tail = eval_each(lisp_tail(list), env);
+        return lisp_cons(head, tail);
     } else {
         // TODO: error
         fprintf(stderr, "bad list: ");
@@ -76,8 +104,8 @@ static LispVal* eval_each(LispVal* list, LispVal* env)
 
 static _Bool good_list(LispVal* list)
 {
-    for (; list->tag != LNIL; list = list->tail)
-        if (list->tag != LCONS)
+    for (; lisp_tag(list) != LNIL; list = lisp_tail(list))
+        if (lisp_tag(list) != LCONS)
             return 0;
     return 1;
 }
@@ -86,45 +114,79 @@ static _Bool good_list(LispVal* list)
 static int list_length(LispVal* list)
 {
     int result = 0;
-    for (; list->tag != LNIL; list = list->tail)
+    for (; lisp_tag(list) != LNIL; list = lisp_tail(list))
         result++;
     return result;
 }
 
-static _Bool is_the_atom(const char* symbol, LispVal* val)
+// The special forms, known by the ids given to their symbols
+enum Form {
+    NOT_A_FORM,
+    FORM_LAMBDA,
+    FORM_MACRO,
+    FORM_QUOTE,
+    FORM_IF,
+    FORM_EVAL,
+    FORM_BEGIN,
+    FORM_DEFINE,
+    FORM_QUASIQUOTE,
+    FORM_UNQUOTE,
+    FORM_UNQUOTE_SPLICING,
+    NUM_FORMS
+};
+
+static const char* const form_names[NUM_FORMS] = {
+    [FORM_LAMBDA] = "lambda",
+    [FORM_MACRO] = "macro",
+    [FORM_QUOTE] = "quote",
+    [FORM_IF] = "if",
+    [FORM_EVAL] = "eval",
+    [FORM_BEGIN] = "begin",
+    [FORM_DEFINE] = "define",
+    [FORM_QUASIQUOTE] = "quasiquote",
+    [FORM_UNQUOTE] = "unquote",
+    [FORM_UNQUOTE_SPLICING] = "unquote-splicing",
+};
+
+static Symbol form_symbols[NUM_FORMS];
+
+static enum Form form_of(LispVal* val)
 {
-    return val->tag == LATOM && sym_equal(val->atom, sym(symbol));
+    return (lisp_tag(val) == LATOM) ? sym_id(val->atom) : NOT_A_FORM;
 }
 
 static LispVal* eval_each_quasi(LispVal* list, LispVal* env, int quote_level)
 {
-    if (list->tag == LNIL) {
+    if (lisp_tag(list) == LNIL) {
         return list;
-    } else if (list->tag == LCONS) {
-        LispVal* head = list->head;
+    } else if (lisp_tag(list) == LCONS) {
+        LispVal* head = lisp_head(list);
+        LispVal* evalled_tail = NULL;
+        GC_PROTECT(&list, &env, &head, &evalled_tail);
         if (quote_level == 0 && good_list(head)
                 && list_length(head) == 2
-                && is_the_atom("unquote-splicing", head->head)) {
+                && form_of(lisp_head(head)) == FORM_UNQUOTE_SPLICING) {
             // (... (unquote-splicing <val>) ...)
-            LispVal* evalled_tail = eval_each_quasi(list->tail, env, 0);
-            LispVal* unquoted = eval_with_env(head->tail->head, env);
+            evalled_tail = eval_each_quasi(lisp_tail(list), env, 0);
+            LispVal* unquoted = eval_with_env(lisp_cadr(head), env);
             if (!good_list(unquoted)) {
                 return lisp_err("unquote-splicing must expand to a list");
             }
-            if (unquoted->tag == LNIL)
+            if (lisp_tag(unquoted) == LNIL)
                 return evalled_tail;
             // splice evalled_tail onto end of unquoted
-            for (LispVal* e = unquoted; e->tag != LNIL; e = e->tail) {
-                if (e->tail->tag == LNIL) {
-                    e->tail = evalled_tail;
+            for (LispVal* e = unquoted; lisp_tag(e) != LNIL; e = lisp_tail(e)) {
+                if (lisp_tag(lisp_tail(e)) == LNIL) {
+                    lisp_set_tail(e, evalled_tail);
+                    gc_write_barrier(e, evalled_tail);
                     break;
                 }
             }
             return unquoted;
         }
-        return lisp_cons(
-                eval_quasi(list->head, env, quote_level),
-                eval_each_quasi(list->tail, env, quote_level));
+        head = eval_quasi(lisp_head(list), env, quote_level);
+        LispVal* tail = eval_each_quasi(lisp_tail(list), env, quote_level);
+        return lisp_cons(head, tail);
     } else {
         // TODO: error
         fprintf(stderr, "bad list: ");
@@ -136,30 +198,38 @@ static LispVal* eval_each_quasi(LispVal* list, LispVal* env, int quote_level)
 
 static LispVal* eval_quasi(LispVal* template, LispVal* env, int quote_level)
 {
+    LispVal* inner = NULL;
+    GC_PROTECT(&template, &env, &inner);
     if (good_list(template)) {
         if (list_length(template) == 2) {
             if (quote_level == 0) {
-                if (is_the_atom("unquote", template->head)) {
-                    return eval_with_env(template->tail->head, env);
-                } else if (is_the_atom("unquote-splicing", template->head)) {
+                if (form_of(lisp_head(template)) == FORM_UNQUOTE) {
+                    return eval_with_env(lisp_cadr(template), env);
+                } else if (form_of(lisp_head(template))
+                        == FORM_UNQUOTE_SPLICING) {
                     return lisp_err("unquote-splicing must be inside a list");
                 }
             } else {
-                if (is_the_atom("unquote", template->head)
-                        || is_the_atom("unquote-splicing", template->head)) {
+                if (form_of(lisp_head(template)) == FORM_UNQUOTE
+                        || form_of(lisp_head(template))
+                            == FORM_UNQUOTE_SPLICING) {
                     // decrease quote-level
+                    inner = eval_quasi(lisp_cadr(template), env,
+                            quote_level - 1);
+                    LispVal* nil = lisp_nil();
+                    inner = lisp_cons(inner, nil);
                     return lisp_cons(
-                            template->head, // unquote/unquote-splicing
-                            lisp_cons(
-                                eval_quasi(template->tail->head, env, quote_level - 1),
-                                lisp_nil()));
-                } else if (is_the_atom("quasiquote", template->head)) {
+                            lisp_head(template), // unquote/unquote-splicing
+                            inner);
+                } else if (form_of(lisp_head(template)) == FORM_QUASIQUOTE) {
                     // increase quote-level
+                    inner = eval_quasi(lisp_cadr(template), env,
+                            quote_level + 1);
+                    LispVal* nil = lisp_nil();
+                    inner = lisp_cons(inner, nil);
                     return lisp_cons(
-                            template->head, // quasiquote
-                            lisp_cons(
-                                eval_quasi(template->tail->head, env, quote_level + 1),
-                                lisp_nil()));
+                            lisp_head(template), // quasiquote
+                            inner);
                 }
             }
         }
@@ -181,7 +251,7 @@ static LispVal* eval_with_env(LispVal* expr, LispVal* env)
         print_lispval(stderr, env);
         fputs("\n", stderr);
     }
-    switch (expr->tag)
+    switch (lisp_tag(expr))
     {
         case LNUM:
         case LNIL:
@@ -191,19 +261,22 @@ static LispVal* eval_with_env(LispVal* expr, LispVal* env)
         case LERROR:
         case LCHAR:
         case LMAC: // The lambda is itself
+        case LWEAK:
+        case LEPHEMERON:
+        case LTABLE:
             return expr;
         case LATOM:
         {
             // lookup in the environment
-            for (LispVal* e = env; e->tag != LNIL; e = e->tail) {
-                LispVal* nvp = e->head; // (name . value)
-                if (sym_equal(expr->atom, nvp->head->atom)) {
+            for (LispVal* e = env; lisp_tag(e) != LNIL; e = lisp_tail(e)) {
+                LispVal* nvp = lisp_head(e); // (name . value)
+                if (sym_equal(expr->atom, lisp_head(nvp)->atom)) {
                     if (debug_evaluator) {
                         fprintf(stderr, "evaluates to: ");
-                        print_lispval(stderr, nvp->tail);
+                        print_lispval(stderr, lisp_tail(nvp));
                         fprintf(stderr, "\n");
                     }
-                    return nvp->tail;
+                    return lisp_tail(nvp);
                 }
             }
             // TODO: return an error
@@ -217,115 +290,142 @@ static LispVal* eval_with_env(LispVal* expr, LispVal* env)
                         "application or macro use");
             }
             // Evaluate a combination
-            LispVal* const head = expr->head;
-            if (head->tag == LATOM) {
-                // Check for special forms
-                if (sym_equal(head->atom, sym("lambda"))
-                        || sym_equal(head->atom, sym("macro"))) {
+            LispVal* head = lisp_head(expr);
+            LispVal* op = NULL;
+            LispVal* args = NULL;
+            GC_PROTECT(&expr, &env, &head, &op, &args);
+            switch (form_of(head)) {
+                case FORM_LAMBDA:
+                case FORM_MACRO:
+                {
                     if (list_length(expr) < 3) {
                         return lisp_err("bad special form");
                     }
                     // TODO: support rest args
-                    LispVal* params = expr->tail->head;
+                    LispVal* params = lisp_cadr(expr);
                     if (!good_list(params)) {
                         return lisp_err("bad special form: params must be list");
                     }
-                    for (LispVal* p = params; p->tag != LNIL; p = p->tail) {
-                        if (p->head->tag != LATOM) {
+                    for (LispVal* p = params; lisp_tag(p) != LNIL;
+                            p = lisp_tail(p)) {
+                        if (lisp_tag(lisp_head(p)) != LATOM) {
                             return lisp_err("bad special form: lambda params"
                                     "must be atoms");
                         }
                     }
-                    LispVal* body = expr->tail->tail;
-                    if (sym_equal(head->atom, sym("macro"))) {
-                        return lisp_macro(params, body, env);
-                    }
-                    return lisp_lam(params, body, env);
-                } else if (sym_equal(head->atom, sym("quote"))) {
-                    if (list_length(expr) != 2) {
-                        return lisp_err("wrong number of arguments to special "
-                                "form: quote");
-                    }
-                    return expr->tail->head;
-                } else if (sym_equal(head->atom, sym("if"))) {
-                    // (if <test> <consequent> <alternate>)
-                    if (list_length(expr) != 4) {
-                        return lisp_err("incorrect syntax for if");
-                    }
-                    LispVal* test_result = eval_with_env(expr->tail->head, env);
-                    if (test_result->tag == LBOOL && !test_result->boolean) {
-                        // False
-                        return eval_with_env(expr->tail->tail->tail->head, env);
-                    } else {
-                        return eval_with_env(expr->tail->tail->head, env);
-                    }
-                } else if (sym_equal(head->atom, sym("eval"))) {
-                    if (list_length(expr) != 2) {
-                        return lisp_err("wrong number of args to eval");
-                    }
-                    return eval_with_env(
-                            eval_with_env(expr->tail->head, env), env);
-                } else if (sym_equal(head->atom, sym("begin"))) {
-                    return eval_body(expr->tail, env);
-                } else if (sym_equal(head->atom, sym("define"))) {
-                    // (define <variable> <expression>)
-                    // (define (<variable> <formals>) <expression>)
-                    if (list_length(expr) != 3) {
-                        return lisp_err("bad special form: define");
-                    }
-                    if (expr->tail->head->tag == LATOM) {
-                        LispVal* varname = expr->tail->head;
-                        LispVal* value =
-                            eval_with_env(expr->tail->tail->head, env);
-
-                        // save a copy of env, overwrite env with our new
-                        // definition and set the tail to be the saved copy
-                        LispVal* saved_env = lisp_cons(env->head, env->tail);
-                        env->head = lisp_cons(varname, value);
-                        env->tail = saved_env;
-                        return env->head;
-                    }
-                    if (good_list(expr->tail->head)) {
-                        LispVal* var_and_formals = expr->tail->head;
-                        if (var_and_formals->head->tag == LATOM) {
-                            LispVal* lambda =
-                                lisp_cons(lisp_atom(sym("lambda")),
-                                        lisp_cons(var_and_formals->tail,
-                                            expr->tail->tail));
-                            return eval_with_env(
-                                    lisp_cons(head, // define
-                                        lisp_cons(var_and_formals->head, // <var>
-                                            lisp_cons(lambda,
-                                                lisp_nil()))), env);
-                        }
-                    }
-                    return lisp_err("bad special form: define");
-                } else if (sym_equal(head->atom, sym("quasiquote"))) {
-                    if (list_length(expr) != 2) {
-                        return lisp_err("wrong number of arguments to special "
-                                "form: quasiquote");
+                    // The procedure shares (params . body) with expr
+                    LispVal* code = lisp_tail(expr);
+                    if (form_of(head) == FORM_MACRO) {
+                        return lisp_macro(code, env);
                     }
-                    return eval_quasi(expr->tail->head, env, 0);
-                } else if (sym_equal(head->atom, sym("unquote"))) {
-                    return lisp_err("unquote must be in quasiquote");
-                } else if (sym_equal(head->atom, sym("unquote-splicing"))) {
-                    return lisp_err("unquote-splicing must be in quasiquote");
+                    return lisp_lam(code, env);
+            }
+            case FORM_QUOTE:
+                if (list_length(expr) != 2) {
+                    return lisp_err("wrong number of arguments to special "
+                            "form: quote");
+                }
+                return lisp_cadr(expr);
+            case FORM_IF:
+            {
+                // (if <test> <consequent> <alternate>)
+                if (list_length(expr) != 4) {
+                    return lisp_err("incorrect syntax for if");
+                }
+                LispVal* test_result = eval_with_env(lisp_cadr(expr), env);
+                if (lisp_tag(test_result) == LBOOL
+                        && !lisp_boolean(test_result)) {
+                    // False
+                    return eval_with_env(lisp_cadddr(expr), env);
                 } else {
-                    // Check if it's a macro!
-                    LispVal* op = eval_with_env(expr->head, env);
-                    if (op->tag == LMAC) {
-                        // we basically want to apply the lambda to the tail
-                        // then eval the result
-                        // In a compiler, these would be done in two separate
-                        // stages I think
-                        LispVal* expanded = apply(op, expr->tail);
-                        return eval_with_env(expanded, env);
+                    return eval_with_env(lisp_caddr(expr), env);
+                }
+            }
+            case FORM_EVAL:
+            {
+                if (list_length(expr) != 2) {
+                    return lisp_err("wrong number of args to eval");
+                }
+                LispVal* evaluated = eval_with_env(lisp_cadr(expr), env);
+                return eval_with_env(evaluated, env);
+            }
+            case FORM_BEGIN:
+                return eval_body(lisp_tail(expr), env);
+            case FORM_DEFINE:
+                // (define <variable> <expression>)
+                // (define (<variable> <formals>) <expression>)
+                if (list_length(expr) != 3) {
+                    return lisp_err("bad special form: define");
+                }
+                if (lisp_tag(lisp_cadr(expr)) == LATOM) {
+                    LispVal* varname = lisp_cadr(expr);
+                    LispVal* value = NULL;
+                    LispVal* saved_env = NULL;
+                    GC_PROTECT(&varname, &value, &saved_env);
+                    value = eval_with_env(lisp_caddr(expr), env);
+
+                    // save a copy of env, overwrite env with our new
+                    // definition and set the tail to be the saved copy
+                    saved_env = lisp_cons(lisp_head(env), lisp_tail(env));
+                    LispVal* definition = lisp_cons(varname, value);
+                    lisp_set_head(env, definition);
+                    gc_write_barrier(env, definition);
+                    lisp_set_tail(env, saved_env);
+                    gc_write_barrier(env, saved_env);
+                    return lisp_head(env);
+                }
+                if (good_list(lisp_cadr(expr))) {
+                    LispVal* var_and_formals = lisp_cadr(expr);
+                    if (lisp_tag(lisp_head(var_and_formals)) == LATOM) {
+                        LispVal* lambda = NULL;
+                        LispVal* form = NULL;
+                        GC_PROTECT(&var_and_formals, &lambda, &form);
+                        lambda = lisp_cons(lisp_tail(var_and_formals),
+                                lisp_cddr(expr));
+                        form = lisp_atom(form_symbols[FORM_LAMBDA]);
+                        lambda = lisp_cons(form, lambda);
+                        // (define <var> (lambda <formals> . <body>))
+                        form = lisp_nil();
+                        form = lisp_cons(lambda, form);
+                        form = lisp_cons(lisp_head(var_and_formals), form);
+                        form = lisp_cons(head, form);
+                        return eval_with_env(form, env);
                     }
                 }
+                return lisp_err("bad special form: define");
+            case FORM_QUASIQUOTE:
+                if (list_length(expr) != 2) {
+                    return lisp_err("wrong number of arguments to special "
+                            "form: quasiquote");
+                }
+                return eval_quasi(lisp_cadr(expr), env, 0);
+            case FORM_UNQUOTE:
+                return lisp_err("unquote must be in quasiquote");
+            case FORM_UNQUOTE_SPLICING:
+                return lisp_err("unquote-splicing must be in quasiquote");
+            default:
+                break;
+            }
+
+            // The operator is evaluated once, and if it names a macro the
+            // expansion is evaluated in place of the call. op and args are
+            // let go of before the call, which roots what it still needs.
+            op = eval_with_env(head, env);
+            if (lisp_tag(head) == LATOM && lisp_tag(op) == LMAC) {
+                // In a compiler, these would be done in two separate
+                // stages I think
+                LispVal* expanded = apply(op, lisp_tail(expr));
+                op = NULL;
+                return eval_with_env(expanded, env);
             }
-            LispVal* evaluated = eval_each(expr, env);
-            assert(evaluated->tag == LCONS);
-            return apply(evaluated->head, evaluated->tail);
+            args = eval_each(lisp_tail(expr), env);
+            LispVal* fn = op;
+            LispVal* fn_args = args;
+            op = args = NULL;
+            profile_enter(profile_site(head), call_depth++);
+            LispVal* result = apply(fn, fn_args);
+            profile_leave(--call_depth);
+            return result;
         }
     }
 }
@@ -339,12 +439,12 @@ LispVal* eval(LispVal* expr)
 LispVal* prim_plus(LispVal* args)
 {
     int result = 0;
-    while (args->tag == LCONS) {
-        if (args->head->tag == LNUM)
-            result += args->head->number;
+    while (lisp_tag(args) == LCONS) {
+        if (lisp_tag(lisp_head(args)) == LNUM)
+            result += lisp_number(lisp_head(args));
         else
             return lisp_err("+: invalid type, expected number");
-        args = args->tail;
+        args = lisp_tail(args);
     }
     return lisp_num(result);
 }
@@ -352,32 +452,32 @@ LispVal* prim_plus(LispVal* args)
 LispVal* prim_multiply(LispVal* args)
 {
     int result = 1;
-    while (args->tag == LCONS) {
-        if (args->head->tag == LNUM)
-            result *= args->head->number;
+    while (lisp_tag(args) == LCONS) {
+        if (lisp_tag(lisp_head(args)) == LNUM)
+            result *= lisp_number(lisp_head(args));
         else
             return lisp_err("*: invalid type, expected number");
-        args = args->tail;
+        args = lisp_tail(args);
     }
     return lisp_num(result);
 }
 
 LispVal* prim_subtract(LispVal* args)
 {
-    if (args->tag != LCONS)
+    if (lisp_tag(args) != LCONS)
         return lisp_err("-: expected at least 1 arg");
-    if (args->head->tag != LNUM)
+    if (lisp_tag(lisp_head(args)) != LNUM)
         return lisp_err("-: invalid type, expected number");
-    int result = args->head->number;
-    args = args->tail;
+    int result = lisp_number(lisp_head(args));
+    args = lisp_tail(args);
 
-    if (args->tag == LCONS) {
-        while (args->tag == LCONS) {
-            if (args->head->tag == LNUM)
-                result -= args->head->number;
+    if (lisp_tag(args) == LCONS) {
+        while (lisp_tag(args) == LCONS) {
+            if (lisp_tag(lisp_head(args)) == LNUM)
+                result -= lisp_number(lisp_head(args));
             else
                 return lisp_err("-: invalid type, expected number");
-            args = args->tail;
+            args = lisp_tail(args);
         }
         return lisp_num(result);
     } else {
@@ -390,32 +490,33 @@ LispVal* prim_subtract(LispVal* args)
 
 LispVal* is_bool(LispVal* args)
 {
-    return lisp_bool(args->head->tag == LBOOL);
+    return lisp_bool(lisp_tag(lisp_head(args)) == LBOOL);
 }
 
 LispVal* is_atom(LispVal* args)
 {
-    return lisp_bool(args->head->tag == LATOM);
+    return lisp_bool(lisp_tag(lisp_head(args)) == LATOM);
 }
 
 LispVal* is_procedure(LispVal* args)
 {
-    return lisp_bool(args->head->tag == LLAM || args->head->tag == LPRIM);
+    return lisp_bool(lisp_tag(lisp_head(args)) == LLAM
+            || lisp_tag(lisp_head(args)) == LPRIM);
 }
 
 LispVal* is_pair(LispVal* args)
 {
-    return lisp_bool(args->head->tag == LCONS);
+    return lisp_bool(lisp_tag(lisp_head(args)) == LCONS);
 }
 
 LispVal* is_number(LispVal* args)
 {
-    return lisp_bool(args->head->tag == LNUM);
+    return lisp_bool(lisp_tag(lisp_head(args)) == LNUM);
 }
 
 LispVal* is_char(LispVal* args)
 {
-    return lisp_bool(args->head->tag == LCHAR);
+    return lisp_bool(lisp_tag(lisp_head(args)) == LCHAR);
 }
 // vector, string, port
 
@@ -425,17 +526,17 @@ LispVal* prim_cons(LispVal* args)
     if (list_length(args) != 2) {
         return lisp_err("cons: expected 2 args");
     }
-    return lisp_cons(args->head, args->tail->head);
+    return lisp_cons(lisp_head(args), lisp_cadr(args));
 }
 LispVal* prim_car(LispVal* args)
 {
     if (list_length(args) != 1) {
         return lisp_err("car: expected 1 arg");
     }
-    if (args->head->tag != LCONS) {
+    if (lisp_tag(lisp_head(args)) != LCONS) {
         return lisp_err("car: invalid type, expected pair");
     }
-    return args->head->head;
+    return lisp_head(lisp_head(args));
 }
 
 LispVal* prim_cdr(LispVal* args)
@@ -443,10 +544,32 @@ LispVal* prim_cdr(LispVal* args)
     if (list_length(args) != 1) {
         return lisp_err("cdr: expected 1 arg");
     }
-    if (args->head->tag != LCONS) {
+    if (lisp_tag(lisp_head(args)) != LCONS) {
         return lisp_err("cdr: invalid type, expected pair");
     }
-    return args->head->tail;
+    return lisp_tail(lisp_head(args));
+}
+
+// Pairs, procedures and the like are only eqv? to themselves
+static _Bool has_identity(enum LispTag tag)
+{
+    return tag == LCONS || tag == LLAM || tag == LMAC
+        || tag == LWEAK || tag == LEPHEMERON || tag == LTABLE;
+}
+
+static _Bool help_eqv(LispVal* left, LispVal* right)
+{
+    if (left == right) {
+        return 1;
+    }
+    // Equal immediates are the same LispVal*
+    enum LispTag tag = lisp_tag(left);
+    if (lisp_is_immediate(left) || lisp_is_immediate(right)
+            || lisp_tag(right) != tag || has_identity(tag)) {
+        return 0;
+    }
+    // eqv? sounds like it has the properties of a memcmp
+    return memcmp(left, right, lisp_boxed_size(tag)) == 0;
 }
 
 LispVal* prim_eqv(LispVal* args)
@@ -454,23 +577,20 @@ LispVal* prim_eqv(LispVal* args)
     if (list_length(args) != 2) {
         return lisp_err("eqv?: expected 2 args");
     }
-    // eqv? sounds like it has the properties of a memcmp
-    // 
-    return lisp_bool(
-            memcmp(args->head, args->tail->head, sizeof *args->head) == 0);
+    return lisp_bool(help_eqv(lisp_head(args), lisp_cadr(args)));
 }
 
 _Bool help_equal(LispVal* left, LispVal* right)
 {
-    if (left->tag == right->tag) {
-        if (left->tag == LCONS) {
-            if (!help_equal(left->head, right->head)) {
+    if (lisp_tag(left) == lisp_tag(right)) {
+        if (lisp_tag(left) == LCONS) {
+            if (!help_equal(lisp_head(left), lisp_head(right))) {
                 return 0;
             }
-            return help_equal(left->tail, right->tail);
+            return help_equal(lisp_tail(left), lisp_tail(right));
         }
         // TODO: strcmp for strings
-        return memcmp(left, right, sizeof *left) == 0;
+        return help_eqv(left, right);
     }
     return 0;
 }
@@ -480,11 +600,247 @@ LispVal* prim_equal(LispVal* args)
     if (list_length(args) != 2) {
         return lisp_err("eqv?: expected 2 args");
     }
-    LispVal* left = args->head;
-    LispVal* right = args->tail->head;
+    LispVal* left = lisp_head(args);
+    LispVal* right = lisp_cadr(args);
     return lisp_bool(help_equal(left, right));
 }
 
+// weak references
+
+LispVal* prim_make_weak_box(LispVal* args)
+{
+    if (list_length(args) != 1) {
+        return lisp_err("make-weak-box: expected 1 arg");
+    }
+    return lisp_weak(lisp_head(args));
+}
+
+LispVal* is_weak_box(LispVal* args)
+{
+    return lisp_bool(lisp_tag(lisp_head(args)) == LWEAK);
+}
+
+// #f once the value has been collected
+LispVal* prim_weak_box_value(LispVal* args)
+{
+    if (list_length(args) != 1) {
+        return lisp_err("weak-box-value: expected 1 arg");
+    }
+    if (lisp_tag(lisp_head(args)) != LWEAK) {
+        return lisp_err("weak-box-value: invalid type, expected weak box");
+    }
+    return lisp_deref(lisp_head(args)->target);
+}
+
+LispVal* prim_make_ephemeron(LispVal* args)
+{
+    if (list_length(args) != 2) {
+        return lisp_err("make-ephemeron: expected 2 args");
+    }
+    return lisp_ephemeron(lisp_head(args), lisp_cadr(args));
+}
+
+LispVal* is_ephemeron(LispVal* args)
+{
+    return lisp_bool(lisp_tag(lisp_head(args)) == LEPHEMERON);
+}
+
+// Both are #f once the key has been collected
+LispVal* prim_ephemeron_key(LispVal* args)
+{
+    if (list_length(args) != 1) {
+        return lisp_err("ephemeron-key: expected 1 arg");
+    }
+    LispVal* e = lisp_head(args);
+    if (lisp_tag(e) != LEPHEMERON) {
+        return lisp_err("ephemeron-key: invalid type, expected ephemeron");
+    }
+    return lisp_ephemeron_broken(e) ? LISP_FALSE : lisp_deref(e->key);
+}
+
+LispVal* prim_ephemeron_value(LispVal* args)
+{
+    if (list_length(args) != 1) {
+        return lisp_err("ephemeron-value: expected 1 arg");
+    }
+    LispVal* e = lisp_head(args);
+    if (lisp_tag(e) != LEPHEMERON) {
+        return lisp_err("ephemeron-value: invalid type, expected ephemeron");
+    }
+    return lisp_ephemeron_broken(e) ? LISP_FALSE : lisp_deref(e->value);
+}
+
+/*
+ * Ephemeron tables map keys, compared with eqv?, to values, holding on to
+ * each value only for as long as its key is alive. The entries are hashed
+ * into a LispTable (see ast.h). Keys with identity are hashed by address, so
+ * the table is hashed again the next time it is used after a collection that
+ * could have moved them, which also drops the ephemerons that have broken.
+ * Otherwise they are dropped when the table next has to grow.
+ */
+LispVal* prim_make_ephemeron_table(LispVal* args)
+{
+    if (list_length(args) != 0) {
+        return lisp_err("make-ephemeron-table: expected 0 args");
+    }
+    return lisp_table();
+}
+
+// Consistent with help_eqv
+static size_t hash_key(LispVal* key, _Bool* by_address)
+{
+    *by_address = !lisp_is_immediate(key) && has_identity(lisp_tag(key));
+    if (lisp_is_immediate(key) || *by_address) {
+        return ((uintptr_t)key >> 2) * (size_t)11400714819323198485ULL;
+    }
+    // FNV-1a of the bytes that eqv? compares
+    const unsigned char* bytes = (const unsigned char*)key;
+    size_t hash = (size_t)14695981039346656037ULL;
+    for (size_t i = 0; i < lisp_boxed_size(lisp_tag(key)); i++) {
+        hash = (hash ^ bytes[i]) * (size_t)1099511628211ULL;
+    }
+    return hash;
+}
+
+static void place_entry(LispTable* table, LispVal* entry)
+{
+    _Bool by_address;
+    LispVal* key = lisp_deref(entry->key);
+    size_t mask = table->size - 1;
+    size_t i = hash_key(key, &by_address) & mask;
+    while (table->slots[i]) {
+        i = (i + 1) & mask;
+    }
+    table->slots[i] = entry;
+    table->count++;
+    table->by_address += by_address;
+    table->young += by_address && gc_is_young(key);
+    table->hashed_at = gc_moves(table->young > 0);
+}
+
+// Into size slots, leaving out the broken ephemerons
+static void rehash_table(LispTable* table, size_t size)
+{
+    LispVal** old = table->slots;
+    size_t old_size = table->size;
+    table->slots = calloc(size, sizeof *table->slots);
+    if (!table->slots) {
+        perror("out of memory");
+        abort();
+    }
+    table->size = size;
+    table->count = table->by_address = table->young = 0;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i] && !lisp_ephemeron_broken(old[i])) {
+            place_entry(table, old[i]);
+        }
+    }
+    free(old);
+}
+
+// In case the keys hashed by address have been moved since
+static void check_hashed(LispTable* table)
+{
+    if (table->by_address
+            && table->hashed_at != gc_moves(table->young > 0)) {
+        rehash_table(table, table->size);
+    }
+}
+
+static LispVal* table_entry(LispTable* table, LispVal* key)
+{
+    check_hashed(table);
+    if (table->size == 0) {
+        return NULL;
+    }
+    _Bool by_address;
+    size_t mask = table->size - 1;
+    for (size_t i = hash_key(key, &by_address) & mask; table->slots[i];
+            i = (i + 1) & mask) {
+        LispVal* entry = table->slots[i];
+        if (!lisp_ephemeron_broken(entry)
+                && help_eqv(lisp_deref(entry->key), key)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void add_entry(LispTable* table, LispVal* entry)
+{
+    check_hashed(table);
+    if (2 * (table->count + 1) > table->size) {
+        size_t live = 0;
+        for (size_t i = 0; i < table->size; i++) {
+            live += table->slots[i] && !lisp_ephemeron_broken(table->slots[i]);
+        }
+        size_t size = 16;
+        while (size < 4 * (live + 1)) {
+            size *= 2;
+        }
+        rehash_table(table, size);
+    }
+    place_entry(table, entry);
+}
+
+// (ephemeron-table-ref table key [default]), default being #f
+LispVal* prim_ephemeron_table_ref(LispVal* args)
+{
+    int num_args = list_length(args);
+    if (num_args != 2 && num_args != 3) {
+        return lisp_err("ephemeron-table-ref: expected 2 or 3 args");
+    }
+    if (lisp_tag(lisp_head(args)) != LTABLE) {
+        return lisp_err("ephemeron-table-ref: invalid type, "
+                "expected ephemeron table");
+    }
+    LispVal* entry = table_entry(lisp_head(args)->table, lisp_cadr(args));
+    if (entry) {
+        return lisp_deref(entry->value);
+    }
+    return (num_args == 3) ? lisp_caddr(args) : LISP_FALSE;
+}
+
+LispVal* prim_ephemeron_table_set(LispVal* args)
+{
+    if (list_length(args) != 3) {
+        return lisp_err("ephemeron-table-set!: expected 3 args");
+    }
+    LispVal* table = lisp_head(args);
+    LispVal* key = lisp_cadr(args);
+    LispVal* value = lisp_caddr(args);
+    if (lisp_tag(table) != LTABLE) {
+        return lisp_err("ephemeron-table-set!: invalid type, "
+                "expected ephemeron table");
+    }
+    LispVal* entry = table_entry(table->table, key);
+    if (entry) {
+        entry->value = lisp_ref(value);
+        gc_write_barrier(entry, value);
+        return lisp_nil();
+    }
+    GC_PROTECT(&table);
+    entry = lisp_old_ephemeron(key, value);
+    add_entry(table->table, entry);
+    gc_write_barrier(table, entry);
+    return lisp_nil();
+}
+
+// (register-finalizer! obj thunk) calls thunk once obj has been collected
+LispVal* prim_register_finalizer(LispVal* args)
+{
+    if (list_length(args) != 2) {
+        return lisp_err("register-finalizer!: expected 2 args");
+    }
+    LispVal* thunk = lisp_cadr(args);
+    if (lisp_tag(thunk) != LLAM && lisp_tag(thunk) != LPRIM) {
+        return lisp_err("register-finalizer!: invalid type, "
+                "expected procedure");
+    }
+    gc_add_finalizer_thunk(lisp_head(args), thunk);
+    return lisp_nil();
+}
+
 LispVal* prim_print_heap_state(LispVal* args)
 {
     void print_heap_state(); // runtime.c
@@ -492,18 +848,80 @@ LispVal* prim_print_heap_state(LispVal* args)
     return lisp_nil();
 }
 
+// Cons (name . value) onto alist, clamping value to fit a number
+static LispVal* add_stat(const char* name, double value, LispVal* alist)
+{
+    LispVal* key = NULL;
+    LispVal* entry = NULL;
+    GC_PROTECT(&alist, &key, &entry);
+    if (value > INT_MAX) {
+        value = INT_MAX;
+    }
+    key = lisp_atom(sym(name));
+    entry = lisp_num(value);
+    entry = lisp_cons(key, entry);
+    return lisp_cons(entry, alist);
+}
+
+/*
+ * The collector's telemetry as an alist. Numbers are only ints, so times are
+ * in microseconds and ratios in percent.
+ */
+LispVal* prim_gc_stats(LispVal* args)
+{
+    struct GCReport r;
+    gc_report(&r);
+
+    LispVal* alist = NULL;
+    GC_PROTECT(&alist);
+    alist = lisp_nil();
+    alist = add_stat("mmu-1s-pct", 100 * r.mmu[3], alist);
+    alist = add_stat("mmu-100ms-pct", 100 * r.mmu[2], alist);
+    alist = add_stat("mmu-10ms-pct", 100 * r.mmu[1], alist);
+    alist = add_stat("mmu-1ms-pct", 100 * r.mmu[0], alist);
+    alist = add_stat("old-survival-pct", 100 * r.old_survival, alist);
+    alist = add_stat("nursery-survival-pct", 100 * r.nursery_survival, alist);
+    alist = add_stat("allocation-rate", r.allocation_rate, alist);
+    alist = add_stat("pause-max-us", 1e6 * r.pause_max, alist);
+    alist = add_stat("pause-p99-us", 1e6 * r.pause_p99, alist);
+    alist = add_stat("pause-p50-us", 1e6 * r.pause_p50, alist);
+    alist = add_stat("gc-time-us", 1e6 * r.gc_seconds, alist);
+    alist = add_stat("throughput-pct", 100 * r.throughput, alist);
+    alist = add_stat("bytes-released", r.bytes_released, alist);
+    alist = add_stat("rss-after-major", r.rss_after_major, alist);
+    alist = add_stat("rss-before-major", r.rss_before_major, alist);
+    alist = add_stat("rss", r.rss, alist);
+    alist = add_stat("immortal-size", r.immortal_size, alist);
+    alist = add_stat("heap-size", r.heap_size, alist);
+    alist = add_stat("bytes-evacuated", r.bytes_evacuated, alist);
+    alist = add_stat("bytes-promoted", r.bytes_promoted, alist);
+    alist = add_stat("bytes-allocated", r.bytes_allocated, alist);
+    alist = add_stat("pauses", r.pauses, alist);
+    alist = add_stat("major-collections", r.major_collections, alist);
+    alist = add_stat("collections", r.collections, alist);
+    return alist;
+}
+
 LispVal* add_prim(Symbol symbol, primfunc primop, LispVal* env)
 {
-    return lisp_cons(
-            lisp_cons(
-                lisp_atom(symbol),
-                lisp_prim(primop)),
-            env);
+    LispVal* atom = NULL;
+    GC_PROTECT(&env, &atom);
+    atom = lisp_atom(symbol);
+    LispVal* prim = lisp_prim(primop);
+    LispVal* binding = lisp_cons(atom, prim);
+    return lisp_cons(binding, env);
 }
 
 void initialize_evaluator()
 {
+    for (int i = 1; i < NUM_FORMS; i++) {
+        form_symbols[i] = sym(form_names[i]);
+        sym_set_id(form_symbols[i], i);
+    }
+    gc_add_root(&env);
     env = lisp_nil();
+    // The primitives are never collected
+    gc_set_immortal(1);
     // TODO: add more primitive operations
     env = add_prim(sym("char?"), is_char, env);
     env = add_prim(sym("boolean?"), is_bool, env);
@@ -521,6 +939,22 @@ void initialize_evaluator()
     env = add_prim(sym("car"), prim_car, env);
     env = add_prim(sym("cdr"), prim_cdr, env);
 
+    env = add_prim(sym("make-weak-box"), prim_make_weak_box, env);
+    env = add_prim(sym("weak-box?"), is_weak_box, env);
+    env = add_prim(sym("weak-box-value"), prim_weak_box_value, env);
+    env = add_prim(sym("make-ephemeron"), prim_make_ephemeron, env);
+    env = add_prim(sym("ephemeron?"), is_ephemeron, env);
+    env = add_prim(sym("ephemeron-key"), prim_ephemeron_key, env);
+    env = add_prim(sym("ephemeron-value"), prim_ephemeron_value, env);
+    env = add_prim(sym("make-ephemeron-table"), prim_make_ephemeron_table,
+            env);
+    env = add_prim(sym("ephemeron-table-ref"), prim_ephemeron_table_ref, env);
+    env = add_prim(sym("ephemeron-table-set!"), prim_ephemeron_table_set,
+            env);
+    env = add_prim(sym("register-finalizer!"), prim_register_finalizer, env);
+
     env = add_prim(sym("print-heap-state"), prim_print_heap_state, env);
+    env = add_prim(sym("gc-stats"), prim_gc_stats, env);
+    gc_set_immortal(0);
 }
 
@@ -7,7 +7,7 @@ void initialize_evaluator();
 
 LispVal* eval(LispVal* expr);
 
-// The environment, so that the GC can take a look
+// The global environment
 extern LispVal* env;
 
 #endif /* __READER__EVALUATOR_H__ */
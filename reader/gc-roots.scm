@@ -0,0 +1,29 @@
+; A global definition whose evaluation spans major collections. The code
+; being run is in the immortal space (it makes a procedure), reachable only
+; from the evaluator's roots, and the collections must still keep the
+; symbols in it. Run with a
+; small heap, with either evaluator:
+;
+;     ./reader -heap-min=64k gc-roots.scm
+;     ./reader -2 -heap-min=64k gc-roots.scm
+;
+; and the last three lines printed should each be #t.
+
+(define build
+  (lambda (self n acc)
+    (if (eqv? n 0) acc (self self (- n 1) (cons n acc)))))
+(define sum
+  (lambda (self l acc)
+    (if (eqv? l '()) acc (self self (cdr l) (+ acc (car l))))))
+(define churn
+  (lambda (self k)
+    (if (eqv? k 0) 'done (begin (build build 1000 '()) (self self (- k 1))))))
+
+(define big (build build 3000 '()))
+(define quoted
+  ((lambda (k) (begin (churn churn k) '(alpha beta gamma delta epsilon))) 300))
+(define v ((lambda (k) (begin (churn churn k) 'zzq)) 600))
+
+(eqv? (sum sum big 0) 4501500)
+(eq? (car (cdr quoted)) 'beta)
+(eq? v 'zzq)
@@ -0,0 +1,211 @@
+#include "profile.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+int alloc_profiling = 0;
+
+struct ProfileFrame profile_frames[PROFILE_MAX_FRAMES];
+int profile_num_frames = 0;
+
+static const char* profile_path;
+static size_t sample_interval;
+static unsigned long long random_state = 0x9e3779b97f4a7c15ULL;
+
+// What made an object, going by its tag
+static const char* constructor_names[] = {
+    "lisp_atom", "lisp_num", "lisp_cons", "lisp_nil", "lisp_lam",
+    "lisp_prim", "lisp_bool", "lisp_err", "lisp_char", "lisp_macro",
+    "lisp_weak", "lisp_ephemeron", "lisp_table"
+};
+#define NUM_CONSTRUCTORS \
+    (int)(sizeof constructor_names / sizeof constructor_names[0])
+
+/*
+ * Each distinct stack of call sites that has been sampled, with the bytes
+ * that it allocated and that survived for each constructor
+ */
+static struct Stack {
+    char* frames; // folded: outermost first, separated by ';'
+    long long allocated[NUM_CONSTRUCTORS + 1]; // the last is for unknowns
+    long long survived[NUM_CONSTRUCTORS + 1];
+} *stacks;
+static int num_stacks;
+static int stacks_capacity;
+
+// open addressing, holding indexes into stacks plus one
+static int* stack_index;
+static int stack_index_size;
+
+// Samples that are still in the nursery
+static struct {
+    int size;
+    int capacity;
+    struct Sample { void* obj; int stack; long long bytes; } *data;
+} pending;
+
+static unsigned long hash_string(const char* s)
+{
+    unsigned long hash = 2166136261UL;
+    for (; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 16777619UL;
+    }
+    return hash;
+}
+
+static void grow_stack_index()
+{
+    int new_size = stack_index_size ? 2 * stack_index_size : 256;
+    int* new_index = calloc(new_size, sizeof *new_index);
+    if (!new_index) { perror("out of memory"); abort(); }
+    for (int i = 0; i < num_stacks; i++) {
+        unsigned long h = hash_string(stacks[i].frames) & (new_size - 1);
+        while (new_index[h]) {
+            h = (h + 1) & (new_size - 1);
+        }
+        new_index[h] = i + 1;
+    }
+    free(stack_index);
+    stack_index = new_index;
+    stack_index_size = new_size;
+}
+
+static int intern_stack(const char* frames)
+{
+    if (2 * (num_stacks + 1) > stack_index_size) {
+        grow_stack_index();
+    }
+    unsigned long h = hash_string(frames) & (stack_index_size - 1);
+    for (; stack_index[h]; h = (h + 1) & (stack_index_size - 1)) {
+        if (strcmp(stacks[stack_index[h] - 1].frames, frames) == 0) {
+            return stack_index[h] - 1;
+        }
+    }
+    if (num_stacks >= stacks_capacity) {
+        stacks_capacity = stacks_capacity ? 2 * stacks_capacity : 64;
+        stacks = realloc(stacks, stacks_capacity * sizeof *stacks);
+        if (!stacks) { perror("out of memory"); abort(); }
+    }
+    struct Stack* stack = &stacks[num_stacks];
+    memset(stack, 0, sizeof *stack);
+    stack->frames = strdup(frames);
+    if (!stack->frames) { perror("out of memory"); abort(); }
+    stack_index[h] = num_stacks + 1;
+    return num_stacks++;
+}
+
+size_t profile_next_interval()
+{
+    // xorshift64*, uniform over [1, 2 * sample_interval] for a mean of about
+    // sample_interval
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    unsigned long long r = random_state * 0x2545f4914f6cdd1dULL;
+    return 1 + r % (2 * sample_interval);
+}
+
+void profile_sample(void* obj, size_t size)
+{
+    static char frames[4096];
+    size_t len = strlen(strcpy(frames, "toplevel"));
+    for (int i = 0; i < profile_num_frames; i++) {
+        size_t site_len = strlen(profile_frames[i].site);
+        if (len + 1 + site_len >= sizeof frames) {
+            break;
+        }
+        frames[len++] = ';';
+        memcpy(frames + len, profile_frames[i].site, site_len + 1);
+        len += site_len;
+    }
+
+    if (pending.size >= pending.capacity) {
+        pending.capacity = pending.capacity ? 2 * pending.capacity : 64;
+        pending.data = realloc(pending.data,
+                pending.capacity * sizeof *pending.data);
+        if (!pending.data) { perror("out of memory"); abort(); }
+    }
+    pending.data[pending.size++] = (struct Sample){
+        .obj = obj,
+        .stack = intern_stack(frames),
+        .bytes = (size > sample_interval) ? size : sample_interval
+    };
+}
+
+// Anything that doesn't start with a header is a pair
+static int constructor_of(void* obj)
+{
+    LispWord first = *(LispWord*)obj;
+    if ((first & 7) != LISP_CONST_BITS || first < LISP_HEADER(0)) {
+        return LCONS;
+    }
+    int tag = LISP_HEADER_TAG(first);
+    return (tag < NUM_CONSTRUCTORS) ? tag : NUM_CONSTRUCTORS;
+}
+
+void profile_nursery_emptied(void* (*survivor)(void* obj))
+{
+    for (int i = 0; i < pending.size; i++) {
+        struct Sample* sample = &pending.data[i];
+        struct Stack* stack = &stacks[sample->stack];
+        void* moved = survivor(sample->obj);
+        if (moved) {
+            int constructor = constructor_of(moved);
+            stack->allocated[constructor] += sample->bytes;
+            stack->survived[constructor] += sample->bytes;
+        } else {
+            stack->allocated[constructor_of(sample->obj)] += sample->bytes;
+        }
+    }
+    pending.size = 0;
+}
+
+static void write_folded(const char* path, int survived)
+{
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return;
+    }
+    for (int i = 0; i < num_stacks; i++) {
+        long long* bytes = survived ? stacks[i].survived : stacks[i].allocated;
+        for (int c = 0; c <= NUM_CONSTRUCTORS; c++) {
+            if (bytes[c]) {
+                fprintf(out, "%s;%s %lld\n", stacks[i].frames,
+                        (c < NUM_CONSTRUCTORS) ? constructor_names[c] : "?",
+                        bytes[c]);
+            }
+        }
+    }
+    fclose(out);
+}
+
+static void write_profile()
+{
+    // Whatever is still in the nursery has been allocated, but we can't say
+    // yet whether it will survive
+    for (int i = 0; i < pending.size; i++) {
+        struct Sample* sample = &pending.data[i];
+        stacks[sample->stack].allocated[constructor_of(sample->obj)] +=
+            sample->bytes;
+    }
+    pending.size = 0;
+
+    write_folded(profile_path, 0);
+
+    char* survived_path = malloc(strlen(profile_path) + sizeof ".survived");
+    if (!survived_path) { perror("out of memory"); abort(); }
+    strcat(strcpy(survived_path, profile_path), ".survived");
+    write_folded(survived_path, 1);
+    free(survived_path);
+}
+
+void profile_start(const char* path, size_t interval)
+{
+    if (!profile_path) {
+        atexit(write_profile);
+    }
+    profile_path = path;
+    sample_interval = interval ? interval : 1;
+    alloc_profiling = 1;
+}
@@ -0,0 +1,85 @@
+#ifndef __READER__PROFILE_H__
+#define __READER__PROFILE_H__
+
+#include <stddef.h>
+#include "ast.h"
+
+/*
+ * Allocation profiling
+ *
+ * Every so many bytes (a random amount averaging the sample interval) the
+ * object being allocated is sampled, along with the stack of Scheme call
+ * sites that the evaluators have told us about. At the next collection we
+ * find out what constructor made it, from its header, and whether it
+ * survived.
+ * At exit, the bytes allocated and surviving for each stack are written out
+ * as folded stacks.
+ */
+extern int alloc_profiling;
+
+/*
+ * The evaluators keep a stack of the procedures being called. A frame is
+ * entered at some depth of the evaluator's own stack, and left once the
+ * evaluator returns back below that depth. Direct recursion shares a frame.
+ */
+#define PROFILE_MAX_FRAMES 128
+
+struct ProfileFrame {
+    const char* site;
+    size_t depth;
+};
+extern struct ProfileFrame profile_frames[PROFILE_MAX_FRAMES];
+extern int profile_num_frames;
+
+static inline void profile_leave(size_t depth)
+{
+    if (alloc_profiling) {
+        while (profile_num_frames > 0
+                && profile_frames[profile_num_frames - 1].depth >= depth) {
+            profile_num_frames--;
+        }
+    }
+}
+
+static inline void profile_enter(const char* site, size_t depth)
+{
+    if (alloc_profiling) {
+        profile_leave(depth);
+        if (profile_num_frames > 0
+                && profile_frames[profile_num_frames - 1].site == site) {
+            return;
+        }
+        if (profile_num_frames < PROFILE_MAX_FRAMES) {
+            profile_frames[profile_num_frames++] =
+                (struct ProfileFrame){ .site = site, .depth = depth };
+        }
+    }
+}
+
+// The name of the call site applying operator
+static inline const char* profile_site(LispVal* operator)
+{
+    return (lisp_tag(operator) == LATOM)
+        ? symtext(operator->atom) : "lambda";
+}
+
+/*
+ * Sample every interval bytes on average, and write the profile to path at
+ * exit. The bytes allocated go in path and the bytes surviving the nursery
+ * in path.survived.
+ */
+void profile_start(const char* path, size_t interval);
+
+// How many bytes of allocation until the next sample
+size_t profile_next_interval();
+
+// Sample obj, which has just been allocated
+void profile_sample(void* obj, size_t size);
+
+/*
+ * Account for the samples in the nursery as it is emptied. survivor returns
+ * where a sampled object was moved to, or NULL if it died.
+ */
+void profile_nursery_emptied(void* (*survivor)(void* obj));
+
+#endif /* __READER__PROFILE_H__ */
@@ -5,6 +5,7 @@
 #include "runtime.h"
 #include "evaluator.h"
 #include "eval2.h"
+#include "profile.h"
 
 int debug_lexer = 0;
 int debug_reader = 0;
@@ -44,9 +45,15 @@ static const char* macro_name(int c)
 
 void push_lispval(LispVal* lv)
 {
+    LispVal* quoted = NULL;
+    GC_PROTECT(&lv, &quoted);
     const char* mn_inst = NULL;
     while (rs_ptr > reader_stack && (mn_inst = macro_name(rs_ptr[-1].tag))) {
-        lv = lisp_cons(lisp_atom(sym(mn_inst)), lisp_cons(lv, lisp_nil()));
+        // (<macro name> <lv>)
+        quoted = lisp_nil();
+        quoted = lisp_cons(lv, quoted);
+        lv = lisp_atom(sym(mn_inst));
+        lv = lisp_cons(lv, quoted);
         pop_val();
         mn_inst = NULL;
     }
@@ -79,7 +86,7 @@ lexswitch:
             }
             case NUM:
             {
-                push_lispval(lisp_num(atoi(symtext(yylval.id))));
+                push_lispval(lisp_num(yylval.number));
                 break;
             }
             case VAR:
@@ -103,6 +110,7 @@ lexswitch:
                 //mark_safepoint(); // communicate with the collector
                 // collapse stack into val
                 LispVal* thelist = lisp_nil();
+                GC_PROTECT(&thelist);
                 tagged_stype* top;
                 while ((top = pop_val())) {
                     if (top->tag == '(')
@@ -111,9 +119,10 @@ lexswitch:
                     if (top->tag == LISPVAL) {
                         thelist = lisp_cons(top->sval.value, thelist);
                     } else if (top->tag == '.') {
-                        if (thelist->tag == LCONS && thelist->tail->tag == LNIL) {
+                        if (lisp_tag(thelist) == LCONS
+                                && lisp_tag(lisp_tail(thelist)) == LNIL) {
                             // (...<rest> . <r1>)
-                            thelist = thelist->head;
+                            thelist = lisp_head(thelist);
                         } else {
                             fprintf(stderr, "syntax error: . placement\n");
                             // don't actually do anything
@@ -239,8 +248,124 @@ lexswitch:
     return NULL; // End of file
 }
 
-void set_stack_high(void** stack_high);
-void set_stack_low(void** stack_low);
+static Symbol lambda_symbol;
+static Symbol macro_symbol;
+
+// Whether a form says lambda or macro anywhere, so may make a procedure
+static int makes_procedure(LispVal* form)
+{
+    for (; lisp_tag(form) == LCONS; form = lisp_tail(form)) {
+        if (makes_procedure(lisp_head(form))) {
+            return 1;
+        }
+    }
+    return lisp_tag(form) == LATOM && (sym_equal(form->atom, lambda_symbol)
+            || sym_equal(form->atom, macro_symbol));
+}
+
+// A copy of a form, made in the immortal space while that is on
+static LispVal* copy_form(LispVal* form)
+{
+    switch (lisp_tag(form)) {
+        case LATOM:
+            return lisp_atom(form->atom);
+        case LNUM: // (which may be boxed)
+            return lisp_num(lisp_number(form));
+        case LCONS:
+            break;
+        default:
+            return form;
+    }
+    LispVal* result = NULL;
+    LispVal* last = NULL;
+    LispVal* pair = NULL;
+    GC_PROTECT(&form, &result, &last, &pair);
+    for (; lisp_tag(form) == LCONS; form = lisp_tail(form)) {
+        pair = copy_form(lisp_head(form));
+        pair = lisp_cons(pair, lisp_nil());
+        if (last) {
+            lisp_set_tail(last, pair);
+            gc_write_barrier(last, pair);
+        } else {
+            result = pair;
+        }
+        last = pair;
+    }
+    if (lisp_tag(form) != LNIL) {
+        pair = copy_form(form); // (...<rest> . <r1>)
+        lisp_set_tail(last, pair);
+        gc_write_barrier(last, pair);
+    }
+    return result;
+}
+
+/*
+ * Parse a heap size such as 65536, 512k, 64m or 1g
+ */
+static size_t parse_size(const char* text)
+{
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'g': case 'G': size *= 1024; /* fall through */
+        case 'm': case 'M': size *= 1024; /* fall through */
+        case 'k': case 'K': size *= 1024;
+            end++;
+    }
+    if (end == text || *end != '\0') {
+        fprintf(stderr, "bad heap size: %s\n", text);
+        exit(EXIT_FAILURE);
+    }
+    return size;
+}
+
+static size_t parse_heap_size(const char* text)
+{
+    size_t size = parse_size(text);
+    if (size < GC_MIN_HEAP_SIZE) {
+        fprintf(stderr, "heap size too small: %s (the least is %dk)\n", text,
+                GC_MIN_HEAP_SIZE / 1024);
+        exit(EXIT_FAILURE);
+    }
+    return size;
+}
+
+/*
+ * Parse a pause time in milliseconds, returning it in seconds
+ */
+static double parse_pause(const char* text)
+{
+    char* end;
+    double ms = strtod(text, &end);
+    if (end == text || *end != '\0' || ms < 0) {
+        fprintf(stderr, "bad pause time: %s\n", text);
+        exit(EXIT_FAILURE);
+    }
+    return ms / 1000.0;
+}
+
+/*
+ * Call the finalizer thunks that collections have found due, between
+ * top-level forms, as ((quote <thunk>))
+ */
+static void run_finalizers(int use_eval2)
+{
+    LispVal* call = NULL;
+    LispVal* quote = NULL;
+    GC_PROTECT(&call, &quote);
+    while ((call = gc_next_finalizer())) {
+        call = lisp_cons(call, lisp_nil());
+        quote = lisp_atom(sym("quote"));
+        call = lisp_cons(quote, call);
+        call = lisp_cons(call, lisp_nil());
+        if (use_eval2) {
+            eval2(call);
+        } else {
+            eval(call);
+        }
+    }
+}
+
 extern int verbose_gc;
 extern int debug_evaluator;
 extern int debug_eval2;
@@ -248,6 +373,31 @@ extern int debug_eval2;
 int main(int argc, char** argv)
 {
     int use_eval2 = 0;
+    size_t heap_min = 512 * 1024;
+    size_t heap_max = 1024 * 1024 * 1024;
+    int heap_min_given = 0;
+    if (getenv("SMALL_SCHEME_HEAP_MIN")) {
+        heap_min = parse_heap_size(getenv("SMALL_SCHEME_HEAP_MIN"));
+        heap_min_given = 1;
+    }
+    if (getenv("SMALL_SCHEME_HEAP_MAX")) {
+        heap_max = parse_heap_size(getenv("SMALL_SCHEME_HEAP_MAX"));
+    }
+    int gc_threads = 1;
+    if (getenv("SMALL_SCHEME_GC_THREADS")) {
+        gc_threads = atoi(getenv("SMALL_SCHEME_GC_THREADS"));
+    }
+    double gc_pause = 0; // stop-the-world unless asked otherwise
+    if (getenv("SMALL_SCHEME_GC_PAUSE")) {
+        gc_pause = parse_pause(getenv("SMALL_SCHEME_GC_PAUSE"));
+    }
+    int gc_conservative = getenv("SMALL_SCHEME_GC_CONSERVATIVE") != NULL;
+    const char* gc_stats = getenv("SMALL_SCHEME_GC_STATS");
+    const char* alloc_profile = getenv("SMALL_SCHEME_ALLOC_PROFILE");
+    size_t alloc_sample = 512 * 1024;
+    if (getenv("SMALL_SCHEME_ALLOC_SAMPLE")) {
+        alloc_sample = parse_size(getenv("SMALL_SCHEME_ALLOC_SAMPLE"));
+    }
     for (int i = 1; i < argc; i++) {
         if (argv[i][0] == '-') {
             if (strcmp(argv[i], "-v") == 0) {
@@ -265,6 +415,23 @@ int main(int argc, char** argv)
                 debug_eval2 = 1;
             } else if (strcmp(argv[i], "-2") == 0) {
                 use_eval2 = 1;
+            } else if (strncmp(argv[i], "-heap-min=", 10) == 0) {
+                heap_min = parse_heap_size(argv[i] + 10);
+                heap_min_given = 1;
+            } else if (strncmp(argv[i], "-heap-max=", 10) == 0) {
+                heap_max = parse_heap_size(argv[i] + 10);
+            } else if (strncmp(argv[i], "-gc-threads=", 12) == 0) {
+                gc_threads = atoi(argv[i] + 12);
+            } else if (strncmp(argv[i], "-gc-pause=", 10) == 0) {
+                gc_pause = parse_pause(argv[i] + 10);
+            } else if (strcmp(argv[i], "-gc-conservative") == 0) {
+                gc_conservative = 1;
+            } else if (strncmp(argv[i], "-gc-stats=", 10) == 0) {
+                gc_stats = argv[i] + 10;
+            } else if (strncmp(argv[i], "-alloc-profile=", 15) == 0) {
+                alloc_profile = argv[i] + 15;
+            } else if (strncmp(argv[i], "-alloc-sample=", 14) == 0) {
+                alloc_sample = parse_size(argv[i] + 14);
             } else {
                 fprintf(stderr, "unknown flag: -%c", argv[i][1]);
             }
@@ -276,7 +443,24 @@ int main(int argc, char** argv)
             }
         }
     }
-    initialize_heap(512 * 1024);
+    if (heap_min > heap_max && !heap_min_given) {
+        heap_min = heap_max;
+    } else if (heap_min > heap_max) {
+        fprintf(stderr, "usage: -heap-min must not be more than -heap-max\n");
+        exit(EXIT_FAILURE);
+    }
+    gc_set_threads(gc_threads);
+    gc_set_pause_target(gc_pause);
+    if (gc_conservative) {
+        gc_set_conservative(__builtin_frame_address(0));
+    }
+    if (alloc_profile) {
+        profile_start(alloc_profile, alloc_sample);
+    }
+    initialize_heap(heap_min, heap_max);
+    if (gc_stats) {
+        gc_write_stats_at_exit(gc_stats);
+    }
     if (use_eval2) {
         initialize_evaluator2();
     } else {
@@ -287,14 +471,8 @@ int main(int argc, char** argv)
     if (!reader_stack) { perror("out of memory"); abort(); }
     rs_ptr = reader_stack;
 
-    /*
-     * A neat, asm-free way I came up with of safely grabbing some stack
-     * bounds.
-     * set_stack_high and set_stack_low are in a separate module so that
-     * the optimizer can't (assume no LTO) get rid of the stack assignment
-     */
-    void* dummy = 0; // use ptr word to get word alignment
-    set_stack_high(&dummy);
+    lambda_symbol = sym_permanent("lambda");
+    macro_symbol = sym_permanent("macro");
 
     for (;;) {
         LispVal* value = reader_read();
@@ -302,16 +480,25 @@ int main(int argc, char** argv)
             break;
         if (!value)
             continue;
+        // The bodies of the program's procedures live as long as the program
+        // does, or near enough, so they're kept out of the way of the
+        // collector. Anything else read, i.e. data and what's only evaluated
+        // once, is left to be collected.
+        if (makes_procedure(value)) {
+            gc_set_immortal(1);
+            value = copy_form(value);
+            gc_set_immortal(0);
+        }
         //print_lispval(stdout, value);
         //printf("\n");
         LispVal* evaluated = (use_eval2) ? eval2(value) : eval(value);
         print_lispval(stdout, evaluated);
         printf("\n");
+        run_finalizers(use_eval2);
 
         if (debug_reader) {
             print_heap_state(); // Just to get a print of GC stats
         }
     }
-    set_stack_high(&dummy);
 }
 
@@ -1,356 +1,2981 @@
 #include <stdlib.h>
+#include <setjmp.h>
 #include <string.h>
 #include <stdio.h>
-#ifdef __linux__
-#  include <bsd/stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __x86_64__
+#include <immintrin.h>
 #endif
 #include "ast.h"
+#include "runtime.h"
 #include "tokens.h"
 #include "reader.h"
-#include "evaluator.h"
+#include "profile.h"
 
 int verbose_gc = 0;
 
-static void* heaps[2];
-static int heap_size;
-static int heap_idx = 0;
-static void* free_ptr;
+/*
+ * The heap is split into two generations. New objects are bump allocated in
+ * the nursery. A minor collection copies whatever survives in the nursery
+ * into the old generation and then empties the nursery.
+ *
+ * The old generation is a mark-region space in the style of Immix. It is
+ * divided into blocks, and blocks into lines. Survivors of the nursery are
+ * bump allocated into holes (runs of free lines) and stay where they are. A
+ * major collection marks what is live, and any line with nothing marked on it
+ * is free again afterwards. Blocks that have become badly fragmented are
+ * evacuated during the major collection, i.e. their survivors are copied out
+ * into free space elsewhere, so that the whole block can be reused.
+ *
+ * Address space is reserved up front for the largest heap we are allowed,
+ * but only heap_size bytes of it are committed. After each major collection
+ * resize_heap decides whether to commit more blocks or hand some back. Only
+ * free blocks off the end can be handed back, so to shrink past a block that
+ * is still in use, allocation is kept below alloc_end and the blocks past it
+ * are evacuated until they are free.
+ */
+#define LINE_SIZE       128
+#define BLOCK_SIZE      (32 * 1024)
+#define LINES_PER_BLOCK (BLOCK_SIZE / LINE_SIZE)
+#define GRANULE         8 // objects in the old generation are aligned to this
+#define NURSERY_GROWTH  16 // a nursery with pinned objects may grow this much
+#define PAGE_BYTES      4096 // granularity of the map of old pages in use
+
+static void* nursery;
+static size_t nursery_size;
+static size_t nursery_space; // reserved for it, which it may grow into
+void* gc_free_ptr; // allocation pointer into the nursery
+void* gc_alloc_limit; // lisp_alloc takes the slow path past here
+
+char* lisp_heap_base; // start of the reservation, block aligned
+static void* old_space; // start of the old generation, block aligned
+static size_t heap_size; // committed size of the old generation
+static size_t alloc_end; // allocation stays below this, while shrinking
+static size_t min_heap_size;
+static size_t max_heap_size; // reserved size of the old generation
+static size_t free_lines; // free lines below alloc_end, not yet handed out
+static size_t free_after_major; // old_space_free() after the last major
+static size_t symbols_after_major; // sym_count() after the last major
+static size_t symbols_in_use; // of those, the ones that weren't just looked up
+static int major_for_symbols; // the one under way isn't for want of room
 static void* safe_line;
 
+/*
+ * Side tables for the old generation. line_used says which lines hold
+ * objects (or have been handed out to be allocated into), and is what the
+ * allocator goes by. line_live is filled in as objects are marked by a major
+ * collection and then replaces line_used once marking is complete.
+ */
+static unsigned char* line_used;
+static unsigned char* line_live;
+static unsigned char* mark_bits; // one per granule
+static struct Block {
+    int used_lines; // as of the last sweep
+    int evacuate; // survivors are to be copied out this collection
+    int free_sweeps; // sweeps in a row that found it free and untouched
+    int released; // its pages have been handed back to the system
+} *blocks;
+static size_t search_line; // where to start looking for the next hole
+static pthread_mutex_t hole_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct GCStats {
     long long num_collections;
+    long long num_major_collections;
     long long total_bytes_allocated;
     long long total_bytes_retained;
+    long long total_bytes_promoted;
+    long long total_bytes_evacuated;
+    long long num_heap_grows;
+    long long num_heap_shrinks;
+    long long num_incremental_steps;
+    long long num_steals;
+    long long num_pauses;
+    long long total_bytes_released;
+    double total_gc_seconds;
+    double max_pause_seconds;
 } gc_stats;
 
+/*
+ * The state of the old generation after the last major collection
+ */
+static struct {
+    int free_blocks;
+    int recyclable_blocks; // with some lines free
+    int full_blocks;
+    int evacuated_blocks;
+    size_t hole_bytes; // free lines in recyclable blocks
+    size_t live_bytes; // in marked objects
+    size_t used_bytes; // in lines with marked objects on
+} census;
+
+/*
+ * Telemetry
+ *
+ * Every pause is counted in a histogram of pause times, and logged (the most
+ * recent PAUSE_LOG_SIZE of them, anyway) with when it started, how long it
+ * took, what it was for and how many bytes it copied. The histogram has four
+ * buckets per power of two microseconds.
+ */
+#define PAUSE_LOG_SIZE      4096
+#define HISTOGRAM_BUCKETS   160
+
+enum PauseKind { PAUSE_MINOR, PAUSE_MAJOR, PAUSE_STEP };
+static const char* pause_kind_names[] = { "minor", "major", "step" };
+
+static struct Pause {
+    double start;
+    double seconds;
+    enum PauseKind kind;
+    long long bytes_copied;
+} pause_log[PAUSE_LOG_SIZE];
+static long long pause_histogram[HISTOGRAM_BUCKETS];
+static double heap_start_time; // when initialize_heap was called
+static const char* stats_path; // where to write JSON stats at exit
+static double last_old_survival; // the fraction of used lines still live
+static size_t rss_before_major; // resident set size either side of the
+static size_t rss_after_major; // last major collection
+
+const double gc_mmu_windows[GC_MMU_WINDOWS] = { 0.001, 0.01, 0.1, 1.0 };
+
+static double last_major_end; // when the previous major collection finished
+static char last_resize[160]; // what resize_heap last decided, and why
+
+struct ObjectList {
+    int size;
+    int capacity;
+    LispVal** data;
+};
+
+static void push_object(struct ObjectList* list, LispVal* obj)
+{
+    if (list->size >= list->capacity) {
+        int new_capacity = list->capacity ? 2 * list->capacity : 256;
+        list->data = realloc(list->data, new_capacity * sizeof *list->data);
+        if (!list->data) { perror("out of memory"); abort(); }
+        list->capacity = new_capacity;
+    }
+    list->data[list->size++] = obj;
+}
+
+/*
+ * Old objects that have had a pointer to a young object stored into them
+ * since the last minor collection. These are extra roots for the minor
+ * collection.
+ */
+static struct ObjectList remembered_set;
+
+/*
+ * The immortal space holds what lives as long as the program does: the
+ * primitives and their environment, and the code of the program's
+ * procedures (see reader.c). Its objects are bump allocated, and never moved
+ * or freed, so a minor collection stops at them. One that has had a pointer
+ * into the heap stored in it is remembered for good in immortal_set, and
+ * scanned at every collection. A major collection traces through the ones it
+ * can reach, marking them in immortal_marks, so that only the symbols of
+ * reachable atoms are kept.
+ */
+#define IMMORTAL_SPACE_SIZE (64 * 1024 * 1024)
+#define IMMORTAL_COMMIT     (1024 * 1024) // committed this much at a time
+
+static void* immortal_space;
+static void* immortal_free; // allocation pointer
+static void* immortal_limit; // end of what is committed so far
+static int allocating_immortal;
+static unsigned char* immortal_remembered; // a bit per granule
+static unsigned char* immortal_marks; // likewise, for this major collection
+static struct ObjectList immortal_set;
+
+/*
+ * Conservative roots (see scan_stack)
+ */
+static int conservative;
+static void* stack_base;
+static unsigned char* nursery_starts; // a bit per granule, set at objects
+static unsigned char* old_starts;
+static unsigned char* old_pages; // a bit per page that any object overlaps
+static unsigned char* pinned_bits; // young objects pinned this collection
+static unsigned char* pinned_scanned; // ...and made grey
+static int num_pinned;
+static void* nursery_high; // the end of everything in the nursery
+static struct ObjectList ambiguous; // what the stack seems to point at
+
+// Pinned objects left in the nursery, in address order
+static struct Range {
+    void* start;
+    void* end;
+    void* skipped_at; // where allocation left off before jumping past it
+} *retained;
+static int num_retained;
+static int retained_capacity;
+static int next_retained; // the first at or after gc_free_ptr
+
+/*
+ * Weak references (see process_weak)
+ */
+static struct ObjectList weak_objects; // each LWEAK and LEPHEMERON
+static struct Finalizer {
+    LispVal* obj; // not traced
+    LispVal* thunk; // or NULL
+    void (*release)(void*); // or NULL
+    void* data;
+} *finalizers;
+static int num_finalizers;
+static int finalizers_capacity;
+static struct ObjectList ready_finalizers; // thunks to be called
+static int next_ready;
+
+/*
+ * Incremental mode
+ *
+ * With a pause target set, major collections mark a bit at a time between
+ * allocations instead of all at once. Every allocation of step_bytes or so
+ * does up to pause_target seconds of marking. The write barrier marks
+ * anything old that gets stored into the heap while marking is under way,
+ * and survivors promoted in the meantime are marked as they are promoted, so
+ * once there is nothing left to mark only the roots need looking at again in
+ * the final pause before sweeping. Fragmented blocks are not evacuated in
+ * this mode.
+ */
+static int gc_threads = 1; // threads sharing a stop-the-world collection
+static double pause_target; // in seconds, 0 for stop-the-world
+static int marking; // an incremental major collection is under way
+static int step_bytes; // allocation between incremental steps
+static void* next_step; // where in the nursery the next step is due
+static void* next_sample; // where the next allocation sample falls
+static double cycle_seconds; // time spent on the current incremental cycle
+
+// Marked, but not yet scanned
+static struct ObjectList mark_stack;
+
 static void collect();
+static void collect_major();
+static void start_marking();
+static void incremental_step();
+static void finish_marking();
+static void update_alloc_limit();
+static void* immortal_alloc(size_t size);
+static void skip_pinned(size_t size);
+static size_t retain_pinned();
+static void grow_nursery();
+static size_t resident_bytes();
+static void* survivor(void* start);
+
+/*
+ * The shadow stack of slots registered with GC_PROTECT
+ */
+LispVal*** gc_root_stack;
+LispVal*** gc_root_sp;
+LispVal*** gc_root_limit;
+
+void gc_grow_root_stack()
+{
+    size_t used = gc_root_sp - gc_root_stack;
+    size_t capacity = gc_root_limit - gc_root_stack;
+    size_t new_capacity = capacity ? 2 * capacity : 4096;
+    gc_root_stack =
+        realloc(gc_root_stack, new_capacity * sizeof *gc_root_stack);
+    if (!gc_root_stack) { perror("out of memory"); abort(); }
+    gc_root_sp = gc_root_stack + used;
+    gc_root_limit = gc_root_stack + new_capacity;
+}
 
-#define ALIGNPTR(x) do { x = (void*)( ((size_t)(x + 7LL)) & -8LL ); } while(0)
+/*
+ * Global roots registered with gc_add_root and gc_add_root_stack
+ */
+static struct {
+    int size;
+    int capacity;
+    struct { LispVal** start; LispVal*** top; } *data;
+} global_roots;
 
-void** stack_ref_low; // void** - cast stack as array of ptrs
-void** stack_ref_high;
-void set_stack_high(void** stack_high);
-void set_stack_low(void** stack_low);
+void gc_add_root_stack(LispVal** start, LispVal*** top)
+{
+    if (global_roots.size >= global_roots.capacity) {
+        int new_capacity =
+            global_roots.capacity ? 2 * global_roots.capacity : 16;
+        global_roots.data = realloc(global_roots.data,
+                new_capacity * sizeof *global_roots.data);
+        if (!global_roots.data) { perror("out of memory"); abort(); }
+        global_roots.capacity = new_capacity;
+    }
+    global_roots.data[global_roots.size].start = start;
+    global_roots.data[global_roots.size].top = top;
+    global_roots.size++;
+}
 
-void* lisp_alloc(size_t size)
+void gc_add_root(LispVal** slot)
 {
-    if (free_ptr + size < heaps[heap_idx] + heap_size) {
-        void* result = free_ptr;
-        memset(result, 0, size); /* want nice clean data. But only memset when
-                                    mutator about to write anyway */
-        free_ptr += size;
-        ALIGNPTR(free_ptr);
+    gc_add_root_stack(slot, NULL);
+}
 
-        gc_stats.total_bytes_allocated += size;
-        return result;
-    } else {
-        void* dummy = 0;
-        set_stack_low(&dummy); // See comment above set_stack_high in reader.c
+void* lisp_alloc_slow(size_t size)
+{
+    if (allocating_immortal) {
+        void* result = immortal_alloc(size);
+        if (result) {
+            return result;
+        }
+    }
+    skip_pinned(size);
+    if (gc_free_ptr + size > nursery + nursery_size) {
         collect();
-        set_stack_low(&dummy);
+        skip_pinned(size);
 
-        if (free_ptr + size < heaps[heap_idx] + heap_size) {
-            return lisp_alloc(size);
+        if (gc_free_ptr + size > nursery + nursery_size) {
+            fprintf(stderr, "gc: out of memory!\n");
+            exit(EXIT_FAILURE);
         }
-        fprintf(stderr, "gc: out of memory!\n");
-        exit(EXIT_FAILURE);
+    } else if (marking && gc_free_ptr + size > next_step) {
+        // There's room, but an incremental step is due first
+        incremental_step();
+        skip_pinned(size);
+    }
+    void* result = gc_free_ptr;
+    gc_free_ptr += size;
+    if (alloc_profiling && gc_free_ptr > next_sample) {
+        profile_sample(result, size);
+        next_sample = gc_free_ptr + profile_next_interval();
+        update_alloc_limit();
+    }
+    return result;
+}
+
+/*
+ * Objects aren't zeroed as they are allocated, so zero everything that was
+ * allocated in one go as the nursery is emptied
+ */
+static void reset_nursery()
+{
+    if (alloc_profiling) {
+        profile_nursery_emptied(survivor);
+        next_sample -= gc_free_ptr - nursery;
+    }
+    gc_stats.total_bytes_allocated += gc_free_ptr - nursery;
+    void* end = gc_free_ptr;
+    if (num_retained > 0 && retained[num_retained - 1].end > end) {
+        end = retained[num_retained - 1].end;
+    }
+    // (apart from anything pinned)
+    if (retain_pinned() > nursery_size / 2) {
+        grow_nursery();
+    }
+    void* from = nursery;
+    for (int i = 0; i < num_retained; i++) {
+        memset(from, 0, retained[i].start - from);
+        from = retained[i].end;
+    }
+    if (from < end) {
+        memset(from, 0, end - from);
+    }
+    gc_free_ptr = nursery;
+    next_retained = 0;
+}
+
+static int is_young(void* ptr)
+{
+    return !lisp_is_immediate(ptr)
+        && ptr >= nursery && ptr < nursery + nursery_size;
+}
+
+static int is_old(void* ptr)
+{
+    return !lisp_is_immediate(ptr)
+        && ptr >= old_space && ptr < old_space + heap_size;
+}
+
+static int is_immortal(void* ptr)
+{
+    return !lisp_is_immediate(ptr)
+        && ptr >= immortal_space && ptr < immortal_free;
+}
+
+// Space in the immortal space, or NULL if it is full
+static void* immortal_alloc(size_t size)
+{
+    if (immortal_free + size > immortal_limit) {
+        if (immortal_limit + IMMORTAL_COMMIT
+                > immortal_space + IMMORTAL_SPACE_SIZE) {
+            return NULL;
+        }
+        if (mprotect(immortal_limit, IMMORTAL_COMMIT,
+                    PROT_READ | PROT_WRITE) != 0) {
+            perror("gc: mprotect");
+            abort();
+        }
+        immortal_limit += IMMORTAL_COMMIT;
+    }
+    void* result = immortal_free;
+    immortal_free += size;
+    return result;
+}
+
+int gc_is_immortal(LispVal* obj)
+{
+    return is_immortal(obj);
+}
+
+int gc_is_young(LispVal* obj)
+{
+    return is_young(obj);
+}
+
+void gc_set_immortal(int on)
+{
+    allocating_immortal = on;
+    // Sends every allocation down the slow path while it is on
+    update_alloc_limit();
+}
+
+static size_t old_space_free()
+{
+    return free_lines * LINE_SIZE;
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t line_index(void* ptr)
+{
+    return (ptr - old_space) / LINE_SIZE;
+}
+
+static struct Block* block_of(void* ptr)
+{
+    return &blocks[(ptr - old_space) / BLOCK_SIZE];
+}
+
+/*
+ * Objects are pointed to with their low bits tagged (see ast.h). Their first
+ * word is a header if they are boxed, or a pair's head.
+ */
+static void* object_start(LispVal* obj)
+{
+    return (void*)((uintptr_t)obj & ~(uintptr_t)7);
+}
+
+static size_t object_size(LispVal* obj, LispWord first_word)
+{
+    return lisp_is_pair(obj)
+        ? sizeof(struct LispPair)
+        : lisp_boxed_size(LISP_HEADER_TAG(first_word));
+}
+
+// A reference to the object at start, tagged like obj
+static LispVal* retag(LispVal* obj, void* start)
+{
+    return (LispVal*)((uintptr_t)start | ((uintptr_t)obj & 7));
+}
+
+static int test_bit(unsigned char* bits, size_t i)
+{
+    return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+// Returns whether it was already set
+static int set_bit(unsigned char* bits, size_t i)
+{
+    unsigned char bit = 1 << (i % 8);
+    return (__atomic_fetch_or(&bits[i / 8], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static int is_marked(void* ptr)
+{
+    size_t granule = (ptr - old_space) / GRANULE;
+    return (mark_bits[granule / 8] >> (granule % 8)) & 1;
+}
+
+/*
+ * The threads taking part in collections. Thread 0 is the mutator's own
+ * thread, which is the only one there is unless gc_threads > 1.
+ */
+struct DequeArray;
+struct Deque {
+    long top;
+    long bottom;
+    struct DequeArray* array;
+};
+
+static struct GCThread {
+    pthread_t thread;
+    struct Deque grey; // copied or marked, but not yet scanned
+    void* alloc_ptr; // the hole this thread is allocating into
+    void* alloc_limit;
+    struct ObjectList promoted; // to be scanned by incremental marking
+    long long steals;
+    size_t live_bytes;
+    size_t promoted_bytes;
+    size_t evacuated_bytes;
+    int kept_young; // left a reference to a pinned young object in place
+} *gc_thread;
+
+static __thread struct GCThread* self;
+
+static void deque_push(struct Deque* d, LispVal* obj);
+
+/*
+ * Mark an old object as live, returning whether it was not already marked
+ */
+static int mark_sized(LispVal* obj, size_t size)
+{
+    void* start = object_start(obj);
+    size_t granule = (start - old_space) / GRANULE;
+    unsigned char bit = 1 << (granule % 8);
+    if (__atomic_fetch_or(&mark_bits[granule / 8], bit, __ATOMIC_RELAXED)
+            & bit) {
+        return 0;
+    }
+    size_t last = line_index(start + size - 1);
+    for (size_t line = line_index(start); line <= last; line++) {
+        __atomic_store_n(&line_live[line], 1, __ATOMIC_RELAXED);
+    }
+    self->live_bytes += size;
+    return 1;
+}
+
+static int mark_object(LispVal* obj)
+{
+    return mark_sized(obj, object_size(obj, *(LispWord*)object_start(obj)));
+}
+
+// Returns whether it was not already marked
+static int mark_immortal(LispVal* obj)
+{
+    return !set_bit(immortal_marks,
+            (object_start(obj) - immortal_space) / GRANULE);
+}
+
+/*
+ * Mark an old or immortal object that the program can reach while marking is
+ * under way
+ */
+static void shade(LispVal** ref)
+{
+    LispVal* obj = *ref;
+    if ((is_old(obj) && mark_object(obj))
+            || (is_immortal(obj) && mark_immortal(obj))) {
+        push_object(&mark_stack, obj);
+    }
+}
+
+static void remember_immortal(LispVal* obj)
+{
+    size_t granule = (object_start(obj) - immortal_space) / GRANULE;
+    unsigned char bit = 1 << (granule % 8);
+    if (!(immortal_remembered[granule / 8] & bit)) {
+        immortal_remembered[granule / 8] |= bit;
+        push_object(&immortal_set, obj);
+    }
+}
+
+// Have the immortal objects that point into the heap scanned
+static void grey_immortal_set()
+{
+    for (int i = 0; i < immortal_set.size; i++) {
+        deque_push(&gc_thread[0].grey, immortal_set.data[i]);
+    }
+}
+
+void gc_write_barrier(LispVal* obj, LispVal* value)
+{
+    if (is_immortal(obj)) {
+        if (is_young(value) || is_old(value)) {
+            remember_immortal(obj);
+        }
+    } else if (!is_old(obj)) {
+        return;
+    } else if (is_young(value)) {
+        push_object(&remembered_set, obj);
+        return;
+    }
+    if (marking) {
+        shade(&value);
     }
 }
 
 static float pct_full()
 {
-    return (float)(free_ptr - heaps[heap_idx]) / ((float)(heap_size));
+    return (float)(gc_free_ptr - nursery) / ((float)(nursery_size));
+}
+
+static float pct_old_full()
+{
+    return 1.0f - (float)old_space_free() / ((float)(alloc_end));
+}
+
+long long gc_moves(int young)
+{
+    return young ? gc_stats.num_collections
+        : gc_stats.num_major_collections;
 }
 
 void print_heap_state()
 {
-    fprintf(stderr, "- heap used: %.2f\n", pct_full());
+    fprintf(stderr, "- nursery used: %.2f\n", pct_full());
+    fprintf(stderr, "- old generation used: %.2f\n", pct_old_full());
     fprintf(stderr, "- num collections: %lld\n", gc_stats.num_collections);
+    fprintf(stderr, "- num major collections: %lld\n",
+            gc_stats.num_major_collections);
     double avg_bytes_retained =
         ((double)gc_stats.total_bytes_retained)
-            / ((double)gc_stats.num_collections);
+            / ((double)gc_stats.num_major_collections);
     fprintf(stderr, "- avg heap retained (bytes): %lf\n", avg_bytes_retained);
     fprintf(stderr, "- avg heap retained (proportion): %f\n",
             avg_bytes_retained / ((double)heap_size));
     fprintf(stderr, "- total bytes allocated: %lld\n",
-            gc_stats.total_bytes_allocated);
+            gc_stats.total_bytes_allocated + (gc_free_ptr - nursery));
+    fprintf(stderr, "- total bytes promoted: %lld\n",
+            gc_stats.total_bytes_promoted);
+    fprintf(stderr, "- total bytes evacuated: %lld\n",
+            gc_stats.total_bytes_evacuated);
+    fprintf(stderr, "- total gc time (s): %f\n", gc_stats.total_gc_seconds);
+    fprintf(stderr, "- old generation size (bytes): %zu (min %zu, max %zu)\n",
+            heap_size, min_heap_size, max_heap_size);
+    fprintf(stderr, "- immortal space (bytes): %zu, %d pointing into the "
+            "heap\n", (size_t)(immortal_free - immortal_space),
+            immortal_set.size);
+    fprintf(stderr, "- resident set (bytes): %zu (%zu before the last major "
+            "collection, %zu after), %lld released\n", resident_bytes(),
+            rss_before_major, rss_after_major,
+            gc_stats.total_bytes_released);
+    fprintf(stderr, "- heap grows: %lld, shrinks: %lld\n",
+            gc_stats.num_heap_grows, gc_stats.num_heap_shrinks);
+    if (gc_stats.num_major_collections > 0) {
+        fprintf(stderr, "- blocks after last major: %d free, %d recyclable, "
+                "%d full (%d evacuated)\n", census.free_blocks,
+                census.recyclable_blocks, census.full_blocks,
+                census.evacuated_blocks);
+        fprintf(stderr, "- fragmentation: %zu bytes live in %zu bytes of "
+                "lines (%.1f%% wasted), %zu bytes of holes\n",
+                census.live_bytes, census.used_bytes,
+                census.used_bytes ? 100.0 * (census.used_bytes
+                    - census.live_bytes) / census.used_bytes : 0.0,
+                census.hole_bytes);
+    }
+    if (gc_threads > 1) {
+        fprintf(stderr, "- gc threads: %d, steals: %lld\n",
+                gc_threads, gc_stats.num_steals);
+    }
+    if (pause_target > 0) {
+        fprintf(stderr, "- pause target (ms): %.3f, incremental steps: %lld\n",
+                1000.0 * pause_target, gc_stats.num_incremental_steps);
+    }
+    struct GCReport report;
+    gc_report(&report);
+    fprintf(stderr, "- pauses: %lld, p50/p99/max pause (ms): "
+            "%.3f/%.3f/%.3f\n", report.pauses, 1000.0 * report.pause_p50,
+            1000.0 * report.pause_p99, 1000.0 * report.pause_max);
+    fprintf(stderr, "- allocation rate (MB/s): %.1f\n",
+            report.allocation_rate / (1024 * 1024));
+    fprintf(stderr, "- survival: %.1f%% of the nursery, %.1f%% of the old "
+            "generation\n", 100.0 * report.nursery_survival,
+            100.0 * report.old_survival);
+    fprintf(stderr, "- mmu:");
+    for (int i = 0; i < GC_MMU_WINDOWS; i++) {
+        fprintf(stderr, " %gms %.1f%%", 1000.0 * gc_mmu_windows[i],
+                100.0 * report.mmu[i]);
+    }
+    fprintf(stderr, "\n");
+    if (last_resize[0]) {
+        fprintf(stderr, "- last resize: %s\n", last_resize);
+    }
 }
 
 void mark_safepoint()
 {
-    safe_line = free_ptr;
-    if (verbose_gc) {
-        fprintf(stderr, "%.2f heap used\n", pct_full());
-    }
-    if (pct_full() > 0.7f) {
-        void* dummy = 0;
-        set_stack_low(&dummy);
+    safe_line = gc_free_ptr;
+    if (gc_free_ptr - nursery > nursery_size / 10 * 7) {
+        if (verbose_gc) {
+            fprintf(stderr, "%.2f heap used\n", pct_full());
+        }
         collect();
-        set_stack_low(&dummy);
+    }
+    // Do the next increment of an incremental collection now, rather than
+    // at an allocation, if it is nearly due
+    if (marking && next_step - gc_free_ptr < step_bytes / 2) {
+        incremental_step();
     }
 }
 
-typedef struct Trail {
-    LispVal** val_ptr;
-    LispVal** val_ptr2;
-    struct Trail* next;
-} Trail;
-// Need to fit our trail node in a LispVal space...
-_Static_assert(sizeof(Trail) <= sizeof(LispVal),
-        "Trail must fit in space of a freed LispVal");
-
-static struct {
-    int size;
-    int capacity;
-    struct { int from_off; int to_off; } *data;
-} copy_mapping;
+/*
+ * Once an object has been copied, its first word where it was is overwritten
+ * with a forwarding word: the new address (as a LispRef) with the low bits of
+ * a header. Any
+ * other reference to it that we come across later just follows that instead
+ * of copying it again. While one thread is copying an object its first word
+ * is BUSY, and other threads wait for the forwarding word to appear. Neither
+ * can be mistaken for a header or for any LispVal in a pair's head.
+ */
+#define BUSY    ((LispWord)3 << 3 | LISP_CONST_BITS)
 
-static void cm_reset()
+static int is_forwarding(LispWord word)
 {
-    if (copy_mapping.capacity == 0) {
-        copy_mapping.data = malloc(1024 * 2 * sizeof(int));
-        copy_mapping.capacity = 1024;
-        if (!copy_mapping.data) { perror("out of memory"); abort(); }
-    }
-    copy_mapping.size = 0;
+    return (word & 7) == LISP_CONST_BITS && word > LISP_HEADER(LISP_LAST_TAG);
 }
 
-static void cm_add_mapping(int from_off, int to_off)
+static void* forwarding_address(LispWord word)
 {
-    if (copy_mapping.size >= copy_mapping.capacity) {
-        copy_mapping.data =
-            reallocf(copy_mapping.data,
-                    2 * copy_mapping.capacity * 2 * sizeof(int));
-        copy_mapping.capacity *= 2;
-        if (!copy_mapping.data) { perror("out of memory"); abort(); }
-    }
-    copy_mapping.data[copy_mapping.size].from_off = from_off;
-    copy_mapping.data[copy_mapping.size].to_off = to_off;
-    copy_mapping.size += 1;
+    return lisp_deref((LispRef)(word & ~(LispWord)7));
 }
 
-static void copy_and_trace_value(
-    LispVal**   current,
-    Trail*      trail_start,
-    LispVal***  rest_of_roots,
-    int         nrest
-);
-
-void collect()
+static LispVal* forwarded(LispVal* obj, LispWord word)
 {
-    // Need:
-    // 1. Stack Roots
-    // 2. Environment root
-    // 3. Reader_stack
-    if (verbose_gc)
-        fprintf(stderr, "performing collection\n");
+    return retag(obj, forwarding_address(word));
+}
 
-    void* old_free_ptr = free_ptr;
-    heap_idx ^= 1; // Flip between 0 and 1
-    free_ptr = heaps[heap_idx];
+// Where an object in the nursery went, or NULL if it didn't survive
+static void* survivor(void* start)
+{
+    LispWord word = *(LispWord*)start;
+    return is_forwarding(word) ? forwarding_address(word) : NULL;
+}
 
-    int num_roots = 1; // 1 for &env - global environment
+/*
+ * Set while tracing is looking at the old generation as well as the nursery,
+ * i.e. for a major collection rather than a minor one
+ */
+static int tracing_old;
 
-    // copy anything that is being read by the reader
-    // The forms being read by the reader should just be directed-acyclic-trees
-    // so hopefully nothing too complicated here
-    tagged_stype* rs = reader_stack;
-    tagged_stype* rsend = rs_ptr;
+/*
+ * Find the next hole (run of free lines in a block that isn't being
+ * evacuated) and hand it to this thread to allocate into. Returns 0 if there
+ * are none left.
+ */
+static int next_hole()
+{
+    pthread_mutex_lock(&hole_lock);
+    size_t num_lines = alloc_end / LINE_SIZE;
+    size_t line = search_line;
+    while (line < num_lines) {
+        if (blocks[line / LINES_PER_BLOCK].evacuate) {
+            line = (line / LINES_PER_BLOCK + 1) * LINES_PER_BLOCK;
+        } else if (line_used[line]) {
+            line++;
+        } else {
+            break;
+        }
+    }
+    if (line >= num_lines) {
+        search_line = num_lines;
+        pthread_mutex_unlock(&hole_lock);
+        return 0;
+    }
+    size_t end = line;
+    size_t block_end = (line / LINES_PER_BLOCK + 1) * LINES_PER_BLOCK;
+    while (end < block_end && !line_used[end]) {
+        line_used[end++] = 1;
+    }
+    blocks[line / LINES_PER_BLOCK].free_sweeps = 0;
+    blocks[line / LINES_PER_BLOCK].released = 0;
+    free_lines -= end - line;
+    search_line = end;
+    pthread_mutex_unlock(&hole_lock);
 
+    self->alloc_ptr = old_space + line * LINE_SIZE;
+    self->alloc_limit = old_space + end * LINE_SIZE;
+    return 1;
+}
 
-    for (tagged_stype* p = rs; p < rsend; p++) {
-        if (p->tag == LISPVAL) {
-            num_roots++;
+/*
+ * Space for an object in the old generation, or NULL if there is no room
+ */
+static void* old_alloc(size_t size)
+{
+    size = (size + GRANULE - 1) & ~(size_t)(GRANULE - 1);
+    while (self->alloc_ptr + size > self->alloc_limit) {
+        if (!next_hole()) {
+            return NULL;
         }
     }
+    void* result = self->alloc_ptr;
+    self->alloc_ptr += size;
+    return result;
+}
 
-    // And now scan our program stack for temporaries in the evaluator
-    int num_heap_items = 0;
-    for (void** it = stack_ref_low; it < stack_ref_high; ++it) {
-        if (*it >= heaps[heap_idx ^ 1] && *it < old_free_ptr) {
-            num_heap_items++;
+/*
+ * Drop whatever holes the threads are part way through. The rest of them is
+ * wasted until it is swept up by the next major collection.
+ */
+static void reset_holes()
+{
+    for (int i = 0; i < gc_threads; i++) {
+        gc_thread[i].alloc_ptr = gc_thread[i].alloc_limit = NULL;
+    }
+    search_line = 0;
+}
 
-            // assume this is a LispVal
-            LispVal** lvref = (LispVal**)it;
-            int tag = (*lvref)->tag;
-            if (tag >= 0 && tag <= LERROR) {
-                if (verbose_gc)
-                    fprintf(stderr, "gc: found ref to %s\n", lv_tagname(*lvref));
-                num_roots++;
-            }
+/*
+ * Claim obj for copying. Returns its original first word, or a forwarding
+ * word if somebody else has already copied it.
+ */
+static LispWord claim(LispVal* obj)
+{
+    LispWord* first = object_start(obj);
+    LispWord word = __atomic_load_n(first, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (is_forwarding(word)) {
+            return word;
+        }
+        if (word == BUSY) {
+            word = __atomic_load_n(first, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(first, &word, BUSY, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return word;
         }
     }
-    if (verbose_gc) {
-        fprintf(stderr, "gc: found %d old heap ptrs on stack\n", num_heap_items);
-    }
+}
 
-    // Allocate array for roots
-    LispVal*** roots = malloc(num_roots * sizeof(*roots));
-    if (!roots) { perror("out of memory"); abort(); }
-    LispVal*** roots_ptr = roots;
+static void install_forwarding(LispVal* obj, void* copy)
+{
+    __atomic_store_n((LispWord*)object_start(obj),
+            (LispWord)lisp_ref(copy) | LISP_CONST_BITS, __ATOMIC_RELEASE);
+}
 
-    // collate ptrs from reader stack
-    for (tagged_stype* p = rs; p < rsend; p++) {
-        if (p->tag == LISPVAL) {
-            *roots_ptr++ = &p->sval.value;
+// The first word has been replaced by BUSY, so it comes from claim instead
+static void copy_object(void* start, LispVal* obj, LispWord word,
+        size_t size)
+{
+    *(LispWord*)start = word;
+    memcpy(start + sizeof word, object_start(obj) + sizeof word,
+            size - sizeof word);
+}
+
+static int is_pinned(LispVal* obj)
+{
+    return num_pinned > 0
+        && test_bit(pinned_bits, (object_start(obj) - nursery) / GRANULE);
+}
+
+/*
+ * A pinned young object stays where it is, but still needs scanning once.
+ * Whatever pointed at it is still pointing into the nursery.
+ */
+static LispVal* keep_pinned(LispVal* obj)
+{
+    if (!set_bit(pinned_scanned, (object_start(obj) - nursery) / GRANULE)) {
+        deque_push(&self->grey, obj);
+    }
+    self->kept_young = 1;
+    return obj;
+}
+
+// Record where an object put in the old generation starts
+static void note_old_start(void* start, size_t size)
+{
+    set_bit(old_starts, (start - old_space) / GRANULE);
+    size_t last = (start + size - 1 - old_space) / PAGE_BYTES;
+    for (size_t page = (start - old_space) / PAGE_BYTES; page <= last; page++) {
+        // (other threads may be setting it too)
+        unsigned char bits =
+            __atomic_load_n(&old_pages[page / 8], __ATOMIC_RELAXED);
+        if (!(bits & (1 << (page % 8)))) {
+            set_bit(old_pages, page);
         }
     }
-    // And the values we found on the stack
-    for (void** it = stack_ref_low; it < stack_ref_high; ++it) {
-        if (*it >= heaps[heap_idx ^ 1] && *it < old_free_ptr) {
-            LispVal** lvref = (LispVal**)it;
-            int tag = (*lvref)->tag;
-            if (tag >= 0 && tag <= LERROR) {
-                *roots_ptr++ = lvref;
-            }
+}
+
+/*
+ * Copy a young object, which we have claimed, into the old generation
+ */
+static LispVal* promote_claimed(LispVal* obj, LispWord word)
+{
+    size_t size = object_size(obj, word);
+    void* start = old_alloc(size);
+    if (!start) {
+        fprintf(stderr, "gc: out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    copy_object(start, obj, word, size);
+    if (conservative) {
+        note_old_start(start, size);
+    }
+    self->promoted_bytes += size;
+    LispVal* copy = retag(obj, start);
+    if (tracing_old || marking) {
+        mark_sized(copy, size);
+        if (!tracing_old) {
+            push_object(&self->promoted, copy);
         }
     }
-    // include global environment
-    *roots_ptr++ = &env;
+    install_forwarding(obj, start);
+    return copy;
+}
 
-    cm_reset();
+/*
+ * Copy a young object into the old generation. The rest of a list's spine
+ * is copied straight after it, before anything hanging off the list, so
+ * that walking the list afterwards (an environment, say) goes through
+ * memory in order. Each pair is only made grey once its tail has been
+ * updated, so that no other thread can be scanning it meanwhile.
+ */
+static LispVal* promote(LispVal* obj)
+{
+    if (is_pinned(obj)) {
+        return keep_pinned(obj);
+    }
+    LispWord word = claim(obj);
+    if (is_forwarding(word)) {
+        return forwarded(obj, word);
+    }
+    LispVal* copy = promote_claimed(obj, word);
+    LispVal* last = copy;
+    while (lisp_is_pair(last)) {
+        LispVal* tail = lisp_tail(last);
+        if (!lisp_is_pair(tail) || !is_young(tail) || is_pinned(tail)) {
+            break;
+        }
+        word = claim(tail);
+        LispVal* next = is_forwarding(word)
+            ? forwarded(tail, word) : promote_claimed(tail, word);
+        lisp_set_tail(last, next);
+        if (is_forwarding(word)) {
+            break;
+        }
+        deque_push(&self->grey, last);
+        last = next;
+    }
+    deque_push(&self->grey, last);
+    return copy;
+}
 
-    for (int i = 0; i < num_roots; i++) {
-        // We may have nulled out our ref to aliases that have already been
-        // copied, so skip those
-        if (roots[i] != NULL) {
-            /*
-            * it's possible for any of the other roots to alias part of the tree
-            * pointed to by a different root, so pass a list of other roots to
-            * check for aliasing as we go
-            */
-            LispVal*** rest_of_roots = &roots[i + 1];
-            int rest_of_roots_count = num_roots - i - 1;
-            copy_and_trace_value(roots[i], NULL,
-                    rest_of_roots, rest_of_roots_count);
+/*
+ * Copy an old object out of a block that is being evacuated. If there's no
+ * room left to copy it to, it gets marked where it is instead, and stays
+ * there.
+ */
+static LispVal* evacuate_object(LispVal* obj)
+{
+    LispWord word = claim(obj);
+    if (is_forwarding(word)) {
+        return forwarded(obj, word);
+    }
+    size_t size = object_size(obj, word);
+    void* start = is_marked(obj) ? NULL : old_alloc(size);
+    if (!start) {
+        int newly_marked = mark_sized(obj, size);
+        __atomic_store_n((LispWord*)object_start(obj), word,
+                __ATOMIC_RELEASE);
+        if (newly_marked) {
+            deque_push(&self->grey, obj);
         }
+        return obj;
     }
+    copy_object(start, obj, word, size);
+    if (conservative) {
+        note_old_start(start, size);
+    }
+    self->evacuated_bytes += size;
+    LispVal* copy = retag(obj, start);
+    mark_sized(copy, size);
+    install_forwarding(obj, start);
+    deque_push(&self->grey, copy);
+    return copy;
+}
 
-    if (verbose_gc) {
-        fprintf(stderr, "gc: collection finished\n");
-        fprintf(stderr, "%.2f heap used\n", pct_full());
+/*
+ * Deal with one reference found while tracing
+ */
+static void trace(LispVal** ref)
+{
+    LispVal* obj = *ref;
+    if (is_young(obj)) {
+        *ref = promote(obj);
+    } else if (tracing_old && is_old(obj)) {
+        if (block_of(obj)->evacuate) {
+            *ref = evacuate_object(obj);
+        } else if (mark_object(obj)) {
+            deque_push(&self->grey, obj);
+        }
+    } else if (tracing_old && is_immortal(obj) && mark_immortal(obj)) {
+        deque_push(&self->grey, obj);
     }
-    gc_stats.num_collections++;
-    gc_stats.total_bytes_retained += (free_ptr - heaps[heap_idx]);
 }
 
-void copy_and_trace_value(
-        LispVal** current, Trail* trail_start,
-        LispVal*** rest_of_roots, int nrest)
+// A compressed field is widened for visit and narrowed again afterwards
+static void visit_ref(LispRef* ref, void (*visit)(LispVal**))
 {
-    for (;;) {
-        if (((void*)*current) >= heaps[heap_idx]
-                && ((void*)*current) < free_ptr) {
-            fprintf(stderr, "warning: this one has already been moved");
-            // Not sure if to return here or not..
-        }
-
-        const int tag = (*current)->tag;
-        if (!(tag >= 0 && tag <= LERROR)) {
-            if (verbose_gc)
-                fprintf(stderr, "gc: bad tag: %d (0x%x)\n", tag, tag);
-            // Look up in copy_mapping
-            int offset = ((void*)*current) - heaps[heap_idx ^ 1];
-            int found = 0;
-            for (int i = 0; i < copy_mapping.size; i++) {
-                if (offset == copy_mapping.data[i].from_off) {
-                    *current =
-                        heaps[heap_idx] + copy_mapping.data[i].to_off;
-                    found = 1;
-                    break;
-                }
+#ifdef COMPRESSED_REFS
+    LispVal* value = lisp_deref(*ref);
+    visit(&value);
+    *ref = lisp_ref(value);
+#else
+    visit(ref);
+#endif
+}
+
+static void visit_fields(LispVal* value, void (*visit)(LispVal**))
+{
+    if (lisp_is_pair(value)) {
+        visit_ref(&lisp_pair(value)->head, visit);
+        visit_ref(&lisp_pair(value)->tail, visit);
+        return;
+    }
+    switch (LISP_HEADER_TAG(value->header)) {
+        case LLAM:
+        case LMAC:
+            visit_ref(&value->code, visit);
+            visit_ref(&value->closure, visit);
+            break;
+        case LTABLE:
+            // A table only holds old ephemerons, which a minor collection
+            // has nothing to do with
+            if (visit == trace && !tracing_old) {
+                break;
             }
-            if (verbose_gc) {
-                if (found) {
-                    fprintf(stderr, "gc: had already been moved but this "
-                            "was an alias\n");
-                } else {
-                    fprintf(stderr, "gc: not found mapping into other heap!\n");
+            for (size_t i = 0; i < value->table->size; i++) {
+                if (value->table->slots[i]) {
+                    visit(&value->table->slots[i]);
                 }
             }
-        } else {
-            // 1. Copy value
-            // 2. Copy the things it points to
-            memcpy(free_ptr, *current, sizeof **current);
-
-            // remember where we mapped this address
-            cm_add_mapping(
-                    ((void*)*current) - heaps[heap_idx ^ 1],
-                    free_ptr - heaps[heap_idx]);
-
-            void* spare_space = *current; /* Save the space we've just freed
-                                            for use in this algorithm */
-
-            *current = free_ptr;
-            free_ptr += sizeof **current;
-            ALIGNPTR(free_ptr);
-
-            if (tag == LCONS) {
-                if (verbose_gc)
-                    fprintf(stderr, "it's a cons, follow head, save tail\n");
-                // -- save a pointer to the tail somewhere
-                // we can use the space we just made by copying current
-                // to store a linked list containing the tail pointers
-                // that we need to come back to
-                Trail* trail_head = spare_space;
-                trail_head->val_ptr = &(*current)->tail;
-                trail_head->val_ptr2 = NULL;
-                trail_head->next = trail_start;
-                trail_start = trail_head;
-
-                // stop-copy the head
-                current = &(*current)->head;
-                // Allow us to loop! (would be a recurse in a functional
-                // language)
-                continue;
-            } else if (tag == LLAM || tag == LMAC) {
-                if (verbose_gc)
-                    fprintf(stderr, "it's a lambda, follow params, save body "
-                            "and closure\n");
-                Trail* trail_head = spare_space;
-                trail_head->val_ptr = &(*current)->body;
-                trail_head->val_ptr2 = &(*current)->closure;
-                trail_head->next = trail_start;
-                trail_start = trail_head;
-
-                // next copy params
-                current = &(*current)->params;
-                // recurse!
-                continue;
-            }
-        }
-
-        if (trail_start) {
-            if (verbose_gc)
-                fprintf(stderr, "it's a %s, clean up our saved tails\n",
-                    lv_tagname(*current));
-            // Clean up the trail mess we've made
-            // Assume we can do this in any order - just take the head
-            current = trail_start->val_ptr;
-            if (trail_start->val_ptr2) {
-                trail_start->val_ptr = trail_start->val_ptr2;
-                trail_start->val_ptr2 = NULL;
-            } else {
-                trail_start = trail_start->next;
-            }
-            // recurse! (or loop as it's known in c :P )
-        } else {
-            if (verbose_gc)
-                fprintf(stderr, "it's a %s, nothing left on this trail\n",
-                    lv_tagname(*current));
-            // No mess and we are not a CONS! DONE! (for this item)
             break;
-        }
+        default:
+            break; // (including the weak fields of LWEAK and LEPHEMERON)
     }
 }
 
-void initialize_heap(size_t initial_heap_size)
+/*
+ * Conservative roots
+ *
+ * With gc_set_conservative, the C stack is scanned as well as the precise
+ * roots, and any word on it that points at or into an object is taken to be
+ * a reference to it. That might just be an integer that happens to look like
+ * one, so it is never updated. Instead the object is pinned where it is, as
+ * in Bartlett's mostly-copying collector: a young one stays in the nursery
+ * rather than being promoted, and an old one's block isn't evacuated. Only
+ * objects that are referred to precisely get moved.
+ *
+ * Bartlett pins whole pages, not being able to tell where objects start. We
+ * find out by parsing the nursery at each collection, and by keeping a bit
+ * per granule of the old generation for each object put there, so only the
+ * objects themselves are pinned. Those in the nursery are retained when it
+ * is emptied, and allocation skips over them until they are next found not
+ * to be pinned, when they are promoted like anything else.
+ */
+
+static int is_header(LispWord word)
+{
+    return (word & 7) == LISP_CONST_BITS
+        && word >= LISP_HEADER(0) && word <= LISP_HEADER(LISP_LAST_TAG);
+}
+
+// Move the allocation pointer past any pinned objects in the way
+static void skip_pinned(size_t size)
 {
-    heap_size = initial_heap_size;
-    for (int i = 0; i < 2; i++) {
-        heaps[i] = malloc(initial_heap_size);
-        if (!heaps[i]) { perror("out of memory"); abort(); }
+    int skipped = 0;
+    while (next_retained < num_retained
+            && gc_free_ptr + size > retained[next_retained].start) {
+        retained[next_retained].skipped_at = gc_free_ptr;
+        if (gc_free_ptr < retained[next_retained].end) {
+            gc_free_ptr = retained[next_retained].end;
+        }
+        next_retained++;
+        skipped = 1;
+    }
+    if (skipped) {
+        update_alloc_limit();
     }
-    free_ptr = heaps[0];
 }
 
+static int compare_ranges(const void* a, const void* b)
+{
+    const struct Range* left = a;
+    const struct Range* right = b;
+    return (left->start > right->start) - (left->start < right->start);
+}
+
+// Work out what must be retained as the nursery is emptied, in bytes
+static size_t retain_pinned()
+{
+    num_retained = 0;
+    for (int i = 0; i < ambiguous.size; i++) {
+        LispVal* obj = ambiguous.data[i];
+        if (!is_young(obj)) {
+            continue;
+        }
+        if (num_retained >= retained_capacity) {
+            retained_capacity = retained_capacity ? 2 * retained_capacity : 64;
+            retained = realloc(retained, retained_capacity * sizeof *retained);
+            if (!retained) { perror("out of memory"); abort(); }
+        }
+        void* start = object_start(obj);
+        retained[num_retained++] = (struct Range){
+            .start = start,
+            .end = start + object_size(obj, *(LispWord*)start),
+            .skipped_at = start
+        };
+    }
+    qsort(retained, num_retained, sizeof *retained, compare_ranges);
+    int merged = 0;
+    for (int i = 0; i < num_retained; i++) {
+        if (merged > 0 && retained[i].start <= retained[merged - 1].end) {
+            if (retained[i].end > retained[merged - 1].end) {
+                retained[merged - 1].end = retained[i].end;
+            }
+        } else {
+            retained[merged++] = retained[i];
+        }
+    }
+    num_retained = merged;
+    ambiguous.size = 0;
+    num_pinned = 0;
+
+    size_t bytes = 0;
+    for (int i = 0; i < num_retained; i++) {
+        bytes += retained[i].end - retained[i].start;
+    }
+    return bytes;
+}
+
+/*
+ * Whatever the stack points at stays young until the stack stops pointing
+ * at it, which with deep recursion can be most of the nursery. So it gets
+ * more room, as far as was reserved for it.
+ */
+static void grow_nursery()
+{
+    size_t new_size = 2 * nursery_size;
+    if (new_size > nursery_space) {
+        new_size = nursery_space;
+    }
+    if (new_size <= nursery_size) {
+        return;
+    }
+    // (from the start of the page that the nursery currently ends in)
+    void* from = (void*)((uintptr_t)(nursery + nursery_size)
+            & ~((uintptr_t)getpagesize() - 1));
+    if (mprotect(from, nursery + new_size - from,
+                PROT_READ | PROT_WRITE) != 0) {
+        perror("gc: mprotect");
+        abort();
+    }
+    if (verbose_gc) {
+        fprintf(stderr, "gc: growing nursery to %zu bytes\n", new_size);
+    }
+    nursery_size = new_size;
+    step_bytes = nursery_size / 16;
+}
+
+// Note where each object from p up to end starts
+static void parse_objects(void* p, void* end)
+{
+    while (p < end) {
+        LispWord first = *(LispWord*)p;
+        size_t size = is_header(first)
+            ? lisp_boxed_size(LISP_HEADER_TAG(first))
+            : sizeof(struct LispPair);
+        if (p + size > end) {
+            break; // (not a whole object, so not one of ours)
+        }
+        set_bit(nursery_starts, (p - nursery) / GRANULE);
+        p += size;
+    }
+}
+
+/*
+ * The nursery is allocated from the start up to gc_free_ptr, apart from the
+ * retained objects, which allocation went around
+ */
+static void find_nursery_objects()
+{
+    nursery_high = gc_free_ptr;
+    if (num_retained > 0 && retained[num_retained - 1].end > nursery_high) {
+        nursery_high = retained[num_retained - 1].end;
+    }
+    size_t bytes = (nursery_high - nursery) / GRANULE / 8 + 1;
+    memset(nursery_starts, 0, bytes);
+    memset(pinned_bits, 0, bytes);
+    memset(pinned_scanned, 0, bytes);
+
+    void* p = nursery;
+    for (int i = 0; i < num_retained; i++) {
+        void* gap_end = retained[i].skipped_at;
+        if (gap_end > gc_free_ptr) {
+            gap_end = gc_free_ptr;
+        }
+        if (p < gap_end) {
+            parse_objects(p, gap_end);
+        }
+        parse_objects(retained[i].start, retained[i].end);
+        p = retained[i].end;
+    }
+    if (p < gc_free_ptr) {
+        parse_objects(p, gc_free_ptr);
+    }
+}
+
+// The object that word points at or into, if any
+static LispVal* find_object(void* word)
+{
+    void* base;
+    unsigned char* starts;
+    if (word >= nursery && word < nursery_high) {
+        base = nursery;
+        starts = nursery_starts;
+    } else if (word >= old_space && word < old_space + heap_size
+            && test_bit(old_pages, (word - old_space) / PAGE_BYTES)) {
+        base = old_space;
+        starts = old_starts;
+    } else {
+        return NULL;
+    }
+    size_t granule = (word - base) / GRANULE;
+    size_t furthest = sizeof(LispVal) / GRANULE;
+    for (size_t back = 0; back < furthest && back <= granule; back++) {
+        if (!test_bit(starts, granule - back)) {
+            continue;
+        }
+        void* start = base + (granule - back) * GRANULE;
+        LispWord first = *(LispWord*)start;
+        LispVal* obj = is_header(first)
+            ? (LispVal*)start : (LispVal*)(start + LISP_PAIR_BITS);
+        return (word < start + object_size(obj, first)) ? obj : NULL;
+    }
+    return NULL;
+}
+
+static int compare_addresses(const void* a, const void* b)
+{
+    void* left = *(void* const*)a;
+    void* right = *(void* const*)b;
+    return (left > right) - (left < right);
+}
+
+// GC_PROTECT slots on the stack, in address order (see scan_stack)
+static void** precise_slots;
+static size_t num_precise;
+static size_t precise_capacity;
+static size_t next_precise;
+#ifdef __x86_64__
+static int use_avx2;
+#endif
+
+/*
+ * A word of the stack, at p, that falls somewhere in the nursery or the old
+ * generation. They are considered in address order.
+ */
+__attribute__((no_sanitize_address))
+static void consider_word(void** p)
+{
+    while (next_precise < num_precise
+            && precise_slots[next_precise] < (void*)p) {
+        next_precise++;
+    }
+    if (next_precise < num_precise && precise_slots[next_precise] == (void*)p) {
+        return;
+    }
+    LispVal* obj = find_object(*p);
+    if (!obj) {
+        return;
+    }
+    if (is_young(obj)) {
+        if (set_bit(pinned_bits, (object_start(obj) - nursery) / GRANULE)) {
+            return; // already found
+        }
+        num_pinned++;
+    }
+    push_object(&ambiguous, obj);
+}
+
+__attribute__((no_sanitize_address))
+static void scan_words(void** p, void** end, uintptr_t low, uintptr_t high)
+{
+    for (; p < end; p++) {
+        if ((uintptr_t)*p - low < high - low) {
+            consider_word(p);
+        }
+    }
+}
+
+#ifdef __x86_64__
+/*
+ * The same, four words at a time. Addresses fit in 63 bits, so signed
+ * comparisons will do.
+ */
+__attribute__((target("avx2"), no_sanitize_address))
+static void scan_words_avx2(void** p, void** end, uintptr_t low,
+        uintptr_t high)
+{
+    __m256i below = _mm256_set1_epi64x(low - 1);
+    __m256i above = _mm256_set1_epi64x(high);
+    for (; p + 4 <= end; p += 4) {
+        __m256i words = _mm256_loadu_si256((__m256i*)p);
+        __m256i inside = _mm256_and_si256(
+                _mm256_cmpgt_epi64(words, below),
+                _mm256_cmpgt_epi64(above, words));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(inside));
+        while (mask) {
+            consider_word(p + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    scan_words(p, end, low, high);
+}
+#endif
+
+/*
+ * Gather up whatever the stack, and the registers, seem to point at, in one
+ * pass. Most words are nowhere near the heap, so are ruled out with a range
+ * check before anything is looked up. Slots registered with GC_PROTECT are
+ * on the stack too, but they are precise and get updated, so they are
+ * skipped; otherwise everything the evaluator is in the middle of would be
+ * pinned. (This reads all of the stack, so isn't for the address
+ * sanitizer's eyes.)
+ */
+__attribute__((noinline, no_sanitize_address))
+static void scan_stack()
+{
+    jmp_buf registers;
+    setjmp(registers);
+
+    num_precise = 0;
+    size_t num_protected = gc_root_sp - gc_root_stack;
+    if (num_protected > precise_capacity) {
+        precise_capacity = 2 * num_protected;
+        precise_slots = realloc(precise_slots,
+                precise_capacity * sizeof *precise_slots);
+        if (!precise_slots) { perror("out of memory"); abort(); }
+    }
+    for (LispVal*** it = gc_root_stack; it < gc_root_sp; ++it) {
+        if ((void*)*it >= (void*)&registers && (void*)*it < stack_base) {
+            precise_slots[num_precise++] = *it;
+        }
+    }
+    qsort(precise_slots, num_precise, sizeof *precise_slots,
+            compare_addresses);
+    next_precise = 0;
+
+    find_nursery_objects();
+    ambiguous.size = 0; // (reusing its storage)
+    num_pinned = 0;
+    uintptr_t low = (uintptr_t)nursery;
+    uintptr_t high = (uintptr_t)(old_space + heap_size);
+#ifdef __x86_64__
+    if (use_avx2) {
+        scan_words_avx2((void**)&registers, stack_base, low, high);
+        return;
+    }
+#endif
+    scan_words((void**)&registers, stack_base, low, high);
+}
+
+static void visit_roots(void (*visit)(LispVal**))
+{
+    // Need:
+    // 1. Slots registered with GC_PROTECT
+    // 2. Global roots (environments, eval2 registers and stack)
+    // 3. Reader_stack
+
+    // anything that is being read by the reader
+    for (tagged_stype* p = reader_stack; p < rs_ptr; p++) {
+        if (p->tag == LISPVAL) {
+            visit(&p->sval.value);
+        }
+    }
+
+    // And the temporaries in the evaluator
+    for (LispVal*** it = gc_root_stack; it < gc_root_sp; ++it) {
+        visit(*it);
+    }
+    if (verbose_gc) {
+        fprintf(stderr, "gc: %d protected slots\n",
+                (int)(gc_root_sp - gc_root_stack));
+    }
+
+    // include global roots
+    for (int i = 0; i < global_roots.size; i++) {
+        LispVal** start = global_roots.data[i].start;
+        LispVal** end = global_roots.data[i].top
+            ? *global_roots.data[i].top : start + 1;
+        for (LispVal** it = start; it < end; ++it) {
+            visit(it);
+        }
+    }
+
+    // finalizers, which aren't weak, unlike the objects they're for
+    for (int i = 0; i < num_finalizers; i++) {
+        if (finalizers[i].thunk) {
+            visit(&finalizers[i].thunk);
+        }
+    }
+    for (int i = next_ready; i < ready_finalizers.size; i++) {
+        visit(&ready_finalizers.data[i]);
+    }
+
+    // and whatever the C stack seems to point at, which has to stay put
+    if (conservative) {
+        scan_stack();
+        for (int i = 0; i < ambiguous.size; i++) {
+            if (is_old(ambiguous.data[i])) {
+                block_of(ambiguous.data[i])->evacuate = 0;
+            }
+            visit(&ambiguous.data[i]);
+        }
+        if (verbose_gc) {
+            fprintf(stderr, "gc: %d ambiguous roots, %d young\n",
+                    ambiguous.size, num_pinned);
+        }
+    }
+}
+
+/*
+ * Parallel tracing
+ *
+ * Collections are done by gc_threads threads (the thread that triggered the
+ * collection and a pool of workers). The root slots are gathered into one
+ * array first, and threads take chunks of it. Each thread copies into its own
+ * hole in the old generation, and keeps the objects it has yet to scan in its
+ * own deque, which idle threads steal from. An object is claimed for copying
+ * by a CAS on its tag, and for marking by an atomic or on its mark bit, so
+ * only one thread ever copies or scans it.
+ */
+#define ROOT_CHUNK 64
+
+/*
+ * A Chase-Lev work-stealing deque. The owning thread pushes and takes at the
+ * bottom, and other threads steal from the top.
+ */
+struct DequeArray {
+    long size;
+    struct DequeArray* older; // kept until the collection is over
+    LispVal* items[];
+};
+
+static struct DequeArray* new_deque_array(long size, struct DequeArray* older)
+{
+    struct DequeArray* a = malloc(sizeof *a + size * sizeof a->items[0]);
+    if (!a) { perror("out of memory"); abort(); }
+    a->size = size;
+    a->older = older;
+    return a;
+}
+
+static void deque_push(struct Deque* d, LispVal* obj)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    struct DequeArray* a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    if (b - t > a->size - 1) {
+        struct DequeArray* bigger = new_deque_array(2 * a->size, a);
+        for (long i = t; i < b; i++) {
+            bigger->items[i % bigger->size] = a->items[i % a->size];
+        }
+        __atomic_store_n(&d->array, bigger, __ATOMIC_RELEASE);
+        a = bigger;
+    }
+    __atomic_store_n(&a->items[b % a->size], obj, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+static LispVal* deque_take(struct Deque* d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    struct DequeArray* a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    LispVal* obj = __atomic_load_n(&a->items[b % a->size], __ATOMIC_RELAXED);
+    if (t == b) {
+        // The last one, which a thief might be after too
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            obj = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return obj;
+}
+
+static LispVal* deque_steal(struct Deque* d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
+        return NULL;
+    }
+    struct DequeArray* a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    LispVal* obj = __atomic_load_n(&a->items[t % a->size], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL; // lost the race, but there may be more
+    }
+    return obj;
+}
+
+static int deque_empty(struct Deque* d)
+{
+    return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE)
+        >= __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
+
+static struct {
+    LispVal*** slots;
+    long size;
+    long capacity;
+    long next; // next chunk to be handed out
+} root_slots;
+
+static int num_idle;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static long pool_epoch; // bumped to start the workers on a collection
+static int pool_running; // workers yet to finish this collection
+
+// (a major collection traces from immortal roots too, for their symbols)
+static void gather_root(LispVal** ref)
+{
+    LispVal* obj = *ref;
+    if (!is_young(obj)
+            && !(tracing_old && (is_old(obj) || is_immortal(obj)))) {
+        return;
+    }
+    if (root_slots.size >= root_slots.capacity) {
+        long new_capacity =
+            root_slots.capacity ? 2 * root_slots.capacity : 1024;
+        root_slots.slots = realloc(root_slots.slots,
+                new_capacity * sizeof *root_slots.slots);
+        if (!root_slots.slots) { perror("out of memory"); abort(); }
+        root_slots.capacity = new_capacity;
+    }
+    root_slots.slots[root_slots.size++] = ref;
+}
+
+static pthread_mutex_t remembered_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Symbols named by live atoms are kept by sym_reclaim
+static void note_symbol(LispVal* obj)
+{
+    if (lisp_tag(obj) == LATOM) {
+        sym_mark(obj->atom);
+    }
+}
+
+static void scan_object(LispVal* obj)
+{
+    self->kept_young = 0;
+    if (tracing_old) {
+        note_symbol(obj);
+    }
+    visit_fields(obj, trace);
+    // An old object left pointing at a pinned young one has to be looked at
+    // again by the next minor collection, in case it has moved by then
+    if (self->kept_young && is_old(obj)) {
+        pthread_mutex_lock(&remembered_lock);
+        push_object(&remembered_set, obj);
+        pthread_mutex_unlock(&remembered_lock);
+    }
+}
+
+static void drain_grey()
+{
+    LispVal* obj;
+    while ((obj = deque_take(&self->grey))) {
+        scan_object(obj);
+    }
+}
+
+static LispVal* steal_grey()
+{
+    int me = self - gc_thread;
+    for (int i = 1; i < gc_threads; i++) {
+        LispVal* obj = deque_steal(&gc_thread[(me + i) % gc_threads].grey);
+        if (obj) {
+            self->steals++;
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+static int any_grey()
+{
+    for (int i = 0; i < gc_threads; i++) {
+        if (!deque_empty(&gc_thread[i].grey)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The part of a collection done by every thread
+ */
+static void trace_work()
+{
+    // Share out the roots
+    for (;;) {
+        long start = __atomic_fetch_add(&root_slots.next, ROOT_CHUNK,
+                __ATOMIC_RELAXED);
+        if (start >= root_slots.size) {
+            break;
+        }
+        long end = start + ROOT_CHUNK;
+        if (end > root_slots.size) {
+            end = root_slots.size;
+        }
+        for (long i = start; i < end; i++) {
+            trace(root_slots.slots[i]);
+        }
+        drain_grey();
+    }
+
+    // Then scan until nobody has anything left to scan. A thread only goes
+    // idle with its own deque empty, and only threads that are not idle make
+    // more work, so once every thread is idle we are done.
+    for (;;) {
+        drain_grey();
+        LispVal* obj = steal_grey();
+        if (obj) {
+            scan_object(obj);
+            continue;
+        }
+        __atomic_add_fetch(&num_idle, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&num_idle, __ATOMIC_SEQ_CST) == gc_threads) {
+                return;
+            }
+            if (any_grey()) {
+                __atomic_sub_fetch(&num_idle, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* gc_worker(void* arg)
+{
+    self = arg;
+    long epoch = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_epoch == epoch) {
+            pthread_cond_wait(&pool_start, &pool_lock);
+        }
+        epoch = pool_epoch;
+        pthread_mutex_unlock(&pool_lock);
+
+        trace_work();
+
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_running == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+static void start_gc_threads()
+{
+    gc_thread = calloc(gc_threads, sizeof *gc_thread);
+    if (!gc_thread) { perror("out of memory"); abort(); }
+    for (int i = 0; i < gc_threads; i++) {
+        gc_thread[i].grey.array = new_deque_array(1024, NULL);
+    }
+    self = &gc_thread[0]; // the mutator thread takes part too
+    for (int i = 1; i < gc_threads; i++) {
+        if (pthread_create(&gc_thread[i].thread, NULL, gc_worker,
+                    &gc_thread[i]) != 0) {
+            perror("gc: pthread_create");
+            abort();
+        }
+    }
+}
+
+/*
+ * Trace everything reachable from the gathered root slots, and from anything
+ * already on thread 0's deque, using every thread
+ */
+static void trace_in_parallel()
+{
+    root_slots.next = 0;
+    num_idle = 0;
+
+    if (gc_threads > 1) {
+        pthread_mutex_lock(&pool_lock);
+        pool_running = gc_threads - 1;
+        pool_epoch++;
+        pthread_cond_broadcast(&pool_start);
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    trace_work();
+
+    pthread_mutex_lock(&pool_lock);
+    while (pool_running > 0) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    root_slots.size = 0;
+    for (int i = 0; i < gc_threads; i++) {
+        struct GCThread* t = &gc_thread[i];
+        gc_stats.num_steals += t->steals;
+        gc_stats.total_bytes_promoted += t->promoted_bytes;
+        gc_stats.total_bytes_evacuated += t->evacuated_bytes;
+        t->steals = t->promoted_bytes = t->evacuated_bytes = 0;
+
+        struct DequeArray* a = t->grey.array;
+        while (a->older) {
+            struct DequeArray* older = a->older;
+            a->older = older->older;
+            free(older);
+        }
+    }
+}
+
+/*
+ * Allocation goes out of line once the nursery is full, or at whichever is
+ * sooner of the next incremental step and the next allocation sample
+ */
+static void update_alloc_limit()
+{
+    if (allocating_immortal) {
+        gc_alloc_limit = gc_free_ptr;
+        return;
+    }
+    gc_alloc_limit = nursery + nursery_size;
+    if (next_retained < num_retained
+            && retained[next_retained].start < gc_alloc_limit) {
+        gc_alloc_limit = retained[next_retained].start;
+    }
+    if (marking && next_step < gc_alloc_limit) {
+        gc_alloc_limit = next_step;
+    }
+    if (alloc_profiling && next_sample < gc_alloc_limit) {
+        gc_alloc_limit = next_sample;
+    }
+}
+
+static void reset_alloc_limit()
+{
+    next_step = gc_free_ptr + step_bytes;
+    update_alloc_limit();
+}
+
+/*
+ * How much free space the old generation needs to be sure of being able to
+ * promote a full nursery, allowing for the holes that a major collection
+ * drops part way through
+ */
+static size_t promotion_room()
+{
+    return nursery_size + gc_threads * BLOCK_SIZE;
+}
+
+/*
+ * Major collections start while there's still this much more than
+ * promotion_room() free, for survivors of fragmented blocks to be evacuated
+ * into
+ */
+static size_t evacuation_reserve()
+{
+    return alloc_end / 20;
+}
+
+static int histogram_bucket(double seconds)
+{
+    unsigned long long us = seconds * 1e6;
+    if (us < 4) {
+        return us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int bucket = 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+    return (bucket < HISTOGRAM_BUCKETS) ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// The (exclusive) upper limit of a bucket, in seconds
+static double bucket_limit(int bucket)
+{
+    if (bucket < 4) {
+        return (bucket + 1) * 1e-6;
+    }
+    int msb = bucket / 4 + 1;
+    return (double)((5ULL + bucket % 4) << (msb - 2)) * 1e-6;
+}
+
+static long long bytes_copied()
+{
+    return gc_stats.total_bytes_promoted + gc_stats.total_bytes_evacuated;
+}
+
+static void record_pause(double start, enum PauseKind kind,
+        long long copied_before)
+{
+    double seconds = now_seconds() - start;
+    struct Pause* pause = &pause_log[gc_stats.num_pauses % PAUSE_LOG_SIZE];
+    pause->start = start;
+    pause->seconds = seconds;
+    pause->kind = kind;
+    pause->bytes_copied = bytes_copied() - copied_before;
+
+    gc_stats.num_pauses++;
+    pause_histogram[histogram_bucket(seconds)]++;
+    if (seconds > gc_stats.max_pause_seconds) {
+        gc_stats.max_pause_seconds = seconds;
+    }
+}
+
+/*
+ * The pause time below which fraction of all pauses fall, accurate to the
+ * width of the histogram bucket it lands in
+ */
+static double pause_percentile(double fraction)
+{
+    long long rank = fraction * gc_stats.num_pauses;
+    long long seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += pause_histogram[b];
+        if (seen > rank) {
+            double limit = bucket_limit(b);
+            return (limit < gc_stats.max_pause_seconds)
+                ? limit : gc_stats.max_pause_seconds;
+        }
+    }
+    return gc_stats.max_pause_seconds;
+}
+
+/*
+ * The logged pauses in the order they happened, with running totals of the
+ * time paused so that paused_in can add up any stretch of them quickly
+ */
+static struct {
+    int count;
+    double start[PAUSE_LOG_SIZE];
+    double end[PAUSE_LOG_SIZE];
+    double paused_before[PAUSE_LOG_SIZE + 1]; // in the pauses before this one
+} timeline;
+
+static void build_timeline()
+{
+    long long logged = gc_stats.num_pauses;
+    long long first = (logged > PAUSE_LOG_SIZE) ? logged - PAUSE_LOG_SIZE : 0;
+    timeline.count = logged - first;
+    for (long long i = first; i < logged; i++) {
+        struct Pause* pause = &pause_log[i % PAUSE_LOG_SIZE];
+        int j = i - first;
+        timeline.start[j] = pause->start;
+        timeline.end[j] = pause->start + pause->seconds;
+        timeline.paused_before[j + 1] =
+            timeline.paused_before[j] + pause->seconds;
+    }
+}
+
+// The time paused before time t
+static double paused_by(double t)
+{
+    // find the first pause ending after t
+    int lo = 0, hi = timeline.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (timeline.end[mid] <= t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    double paused = timeline.paused_before[lo];
+    if (lo < timeline.count && timeline.start[lo] < t) {
+        paused += t - timeline.start[lo];
+    }
+    return paused;
+}
+
+static double paused_in(double a, double b)
+{
+    return paused_by(b) - paused_by(a);
+}
+
+/*
+ * The minimum mutator utilisation: the smallest fraction of any window of
+ * the given length, from when we started (or the oldest logged pause) until
+ * now, that the program got to run in. The worst windows start at the start
+ * of a pause or end at the end of one.
+ */
+static double mmu(double window, double from, double to)
+{
+    if (to - from <= window) {
+        return 1.0 - paused_in(from, to) / (to - from);
+    }
+    double worst = 0;
+    for (int i = 0; i < timeline.count; i++) {
+        double a = timeline.start[i];
+        if (a + window > to) {
+            a = to - window;
+        }
+        double b = timeline.end[i] - window;
+        if (b < from) {
+            b = from;
+        }
+        double paused = paused_in(a, a + window);
+        if (paused > worst) {
+            worst = paused;
+        }
+        paused = paused_in(b, b + window);
+        if (paused > worst) {
+            worst = paused;
+        }
+    }
+    return (worst < window) ? 1.0 - worst / window : 0.0;
+}
+
+void gc_report(struct GCReport* report)
+{
+    double now = now_seconds();
+    long long allocated =
+        gc_stats.total_bytes_allocated + (gc_free_ptr - nursery);
+
+    report->collections = gc_stats.num_collections;
+    report->major_collections = gc_stats.num_major_collections;
+    report->pauses = gc_stats.num_pauses;
+    report->bytes_allocated = allocated;
+    report->bytes_promoted = gc_stats.total_bytes_promoted;
+    report->bytes_evacuated = gc_stats.total_bytes_evacuated;
+    report->heap_size = heap_size;
+    report->immortal_size = immortal_free - immortal_space;
+    report->rss = resident_bytes();
+    report->rss_before_major = rss_before_major;
+    report->rss_after_major = rss_after_major;
+    report->bytes_released = gc_stats.total_bytes_released;
+    report->elapsed_seconds = now - heap_start_time;
+    report->gc_seconds = gc_stats.total_gc_seconds;
+    report->pause_p50 = pause_percentile(0.5);
+    report->pause_p99 = pause_percentile(0.99);
+    report->pause_max = gc_stats.max_pause_seconds;
+    report->allocation_rate = (report->elapsed_seconds > 0)
+        ? allocated / report->elapsed_seconds : 0;
+    report->nursery_survival = (gc_stats.total_bytes_allocated > 0)
+        ? (double)gc_stats.total_bytes_promoted
+            / gc_stats.total_bytes_allocated : 0;
+    report->old_survival = last_old_survival;
+    report->throughput = (report->elapsed_seconds > 0)
+        ? 1 - report->gc_seconds / report->elapsed_seconds : 1;
+
+    build_timeline();
+    double from = (gc_stats.num_pauses > PAUSE_LOG_SIZE)
+        ? timeline.start[0] : heap_start_time;
+    for (int i = 0; i < GC_MMU_WINDOWS; i++) {
+        report->mmu[i] = (now > from) ? mmu(gc_mmu_windows[i], from, now) : 1;
+    }
+}
+
+static void write_stats()
+{
+    FILE* out = (strcmp(stats_path, "-") == 0)
+        ? stderr : fopen(stats_path, "w");
+    if (!out) {
+        perror(stats_path);
+        return;
+    }
+    struct GCReport report;
+    gc_report(&report);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"collections\": %lld,\n", report.collections);
+    fprintf(out, "  \"major_collections\": %lld,\n", report.major_collections);
+    fprintf(out, "  \"bytes_allocated\": %lld,\n", report.bytes_allocated);
+    fprintf(out, "  \"bytes_promoted\": %lld,\n", report.bytes_promoted);
+    fprintf(out, "  \"bytes_evacuated\": %lld,\n", report.bytes_evacuated);
+    fprintf(out, "  \"heap_size\": %zu,\n", report.heap_size);
+    fprintf(out, "  \"immortal_size\": %zu,\n", report.immortal_size);
+    fprintf(out, "  \"rss\": %zu,\n", report.rss);
+    fprintf(out, "  \"rss_before_major\": %zu,\n", report.rss_before_major);
+    fprintf(out, "  \"rss_after_major\": %zu,\n", report.rss_after_major);
+    fprintf(out, "  \"bytes_released\": %lld,\n", report.bytes_released);
+    fprintf(out, "  \"elapsed_seconds\": %f,\n", report.elapsed_seconds);
+    fprintf(out, "  \"gc_seconds\": %f,\n", report.gc_seconds);
+    fprintf(out, "  \"allocation_rate\": %.0f,\n", report.allocation_rate);
+    fprintf(out, "  \"nursery_survival\": %f,\n", report.nursery_survival);
+    fprintf(out, "  \"old_survival\": %f,\n", report.old_survival);
+    fprintf(out, "  \"throughput\": %f,\n", report.throughput);
+    fprintf(out, "  \"pause_seconds\": {\"p50\": %f, \"p99\": %f, "
+            "\"max\": %f},\n", report.pause_p50, report.pause_p99,
+            report.pause_max);
+    fprintf(out, "  \"mmu\": {");
+    for (int i = 0; i < GC_MMU_WINDOWS; i++) {
+        fprintf(out, "%s\"%g\": %f", i ? ", " : "", gc_mmu_windows[i],
+                report.mmu[i]);
+    }
+    fprintf(out, "},\n");
+
+    long long logged = gc_stats.num_pauses;
+    long long first = (logged > PAUSE_LOG_SIZE) ? logged - PAUSE_LOG_SIZE : 0;
+    fprintf(out, "  \"pauses\": [");
+    for (long long i = first; i < logged; i++) {
+        struct Pause* pause = &pause_log[i % PAUSE_LOG_SIZE];
+        fprintf(out, "%s\n    {\"start\": %f, \"seconds\": %f, "
+                "\"kind\": \"%s\", \"bytes_copied\": %lld}",
+                (i > first) ? "," : "", pause->start - heap_start_time,
+                pause->seconds, pause_kind_names[pause->kind],
+                pause->bytes_copied);
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+void gc_write_stats_at_exit(const char* path)
+{
+    if (!stats_path) {
+        atexit(write_stats);
+    }
+    stats_path = path;
+}
+
+/*
+ * Weak references
+ *
+ * The fields of weak boxes and ephemerons aren't traced along with everything
+ * else. Instead every one there is, is kept track of, and once the strong
+ * trace is done, the ephemerons that survived with live keys have their
+ * values traced. That can bring more keys to life, so it is repeated until
+ * nothing changes. Then whatever a weak box or ephemeron refers to that
+ * hasn't survived is dropped from it, and any finalizers for objects that
+ * haven't survived are due.
+ *
+ * A minor collection can't tell whether an old object is dead, so it takes
+ * them all to be alive. They are found out by the next major collection.
+ */
+
+// What became of an object in this collection, or NULL if it didn't survive
+static LispVal* surviving(LispVal* obj)
+{
+    if (lisp_is_immediate(obj) || is_immortal(obj)) {
+        return obj;
+    }
+    if (!is_young(obj) && !tracing_old) {
+        return obj;
+    }
+    if (is_young(obj) && is_pinned(obj)) {
+        return obj;
+    }
+    LispWord word = *(LispWord*)object_start(obj);
+    if (is_forwarding(word)) {
+        return forwarded(obj, word);
+    }
+    return (!is_young(obj) && is_marked(obj)) ? obj : NULL;
+}
+
+// Immortal objects always survive, so one held weakly is traced like any
+// other by a major collection, for the symbols in it
+static int trace_immortal(LispRef* ref)
+{
+    LispVal* obj = lisp_deref(*ref);
+    if (!tracing_old || !is_immortal(obj)
+            || test_bit(immortal_marks,
+                (object_start(obj) - immortal_space) / GRANULE)) {
+        return 0;
+    }
+    visit_ref(ref, trace);
+    return 1;
+}
+
+static void trace_ephemerons()
+{
+    int traced;
+    do {
+        traced = 0;
+        for (int i = 0; i < weak_objects.size; i++) {
+            LispVal* obj = surviving(weak_objects.data[i]);
+            if (obj && LISP_HEADER_TAG(obj->header) == LWEAK) {
+                traced |= trace_immortal(&obj->target);
+            }
+            if (!obj || LISP_HEADER_TAG(obj->header) != LEPHEMERON
+                    || lisp_ephemeron_broken(obj)
+                    || !surviving(lisp_deref(obj->key))) {
+                continue;
+            }
+            traced |= trace_immortal(&obj->key);
+            traced |= trace_immortal(&obj->value);
+            LispVal* value = lisp_deref(obj->value);
+            if (!surviving(value)) {
+                visit_ref(&obj->value, trace);
+                traced = 1;
+            }
+        }
+        if (traced) {
+            trace_in_parallel();
+        }
+    } while (traced);
+}
+
+static void break_weak_references()
+{
+    int kept = 0;
+    for (int i = 0; i < weak_objects.size; i++) {
+        LispVal* obj = surviving(weak_objects.data[i]);
+        if (!obj) {
+            continue;
+        }
+        if (LISP_HEADER_TAG(obj->header) == LWEAK) {
+            LispVal* target = surviving(lisp_deref(obj->target));
+            obj->target = lisp_ref(target ? target : LISP_FALSE);
+        } else if (!lisp_ephemeron_broken(obj)) {
+            LispVal* key = surviving(lisp_deref(obj->key));
+            LispVal* value = surviving(lisp_deref(obj->value));
+            obj->key = lisp_ref(key ? key : LISP_BROKEN);
+            obj->value = lisp_ref(key ? value : LISP_BROKEN);
+        }
+        weak_objects.data[kept++] = obj;
+    }
+    weak_objects.size = kept;
+}
+
+static void find_finalizable()
+{
+    int kept = 0;
+    for (int i = 0; i < num_finalizers; i++) {
+        struct Finalizer* f = &finalizers[i];
+        LispVal* obj = surviving(f->obj);
+        if (obj) {
+            f->obj = obj;
+            finalizers[kept++] = *f;
+            continue;
+        }
+        if (f->thunk) {
+            push_object(&ready_finalizers, f->thunk);
+        }
+        if (f->release) {
+            f->release(f->data);
+        }
+    }
+    num_finalizers = kept;
+}
+
+// Done after tracing, before the nursery is emptied
+static void process_weak()
+{
+    trace_ephemerons();
+    break_weak_references();
+    find_finalizable();
+}
+
+void gc_register_weak(LispVal* obj)
+{
+    push_object(&weak_objects, obj);
+}
+
+static void add_finalizer(struct Finalizer f)
+{
+    if (num_finalizers >= finalizers_capacity) {
+        finalizers_capacity =
+            finalizers_capacity ? 2 * finalizers_capacity : 64;
+        finalizers = realloc(finalizers,
+                finalizers_capacity * sizeof *finalizers);
+        if (!finalizers) { perror("out of memory"); abort(); }
+    }
+    finalizers[num_finalizers++] = f;
+}
+
+void gc_add_finalizer(LispVal* obj, void (*release)(void*), void* data)
+{
+    add_finalizer((struct Finalizer){
+        .obj = obj, .release = release, .data = data
+    });
+}
+
+void gc_add_finalizer_thunk(LispVal* obj, LispVal* thunk)
+{
+    add_finalizer((struct Finalizer){ .obj = obj, .thunk = thunk });
+}
+
+LispVal* gc_next_finalizer()
+{
+    if (next_ready >= ready_finalizers.size) {
+        ready_finalizers.size = next_ready = 0;
+        return NULL;
+    }
+    return ready_finalizers.data[next_ready++];
+}
+
+/*
+ * Promote the survivors in the nursery into the old generation
+ */
+static void collect_minor()
+{
+    if (verbose_gc)
+        fprintf(stderr, "performing minor collection\n");
+
+    double start = now_seconds();
+
+    // The old objects we know of that point into the nursery are scanned
+    // like grey ones, since their fields can't be gathered as root slots
+    // when they are compressed
+    for (int i = 0; i < remembered_set.size; i++) {
+        deque_push(&gc_thread[0].grey, remembered_set.data[i]);
+    }
+    remembered_set.size = 0;
+    grey_immortal_set();
+
+    visit_roots(gather_root);
+    trace_in_parallel();
+    process_weak();
+
+    // Whatever was promoted while marking is under way still needs scanning
+    // by the marker
+    for (int i = 0; i < gc_threads; i++) {
+        struct ObjectList* promoted = &gc_thread[i].promoted;
+        for (int j = 0; marking && j < promoted->size; j++) {
+            push_object(&mark_stack, promoted->data[j]);
+        }
+        promoted->size = 0;
+    }
+
+    reset_nursery();
+
+    if (verbose_gc) {
+        fprintf(stderr, "gc: minor collection finished\n");
+        fprintf(stderr, "%.2f old generation used\n", pct_old_full());
+    }
+    gc_stats.num_collections++;
+
+    gc_stats.total_gc_seconds += now_seconds() - start;
+}
+
+/*
+ * Symbols are only reclaimed by major collections, so a program that reads
+ * or makes lots of them, but keeps little of what it allocates, still needs
+ * one now and then: once it has made as many new ones as were in use
+ */
+#define SYMBOL_SLACK 4096
+
+static int symbols_outgrown()
+{
+    return sym_count() > symbols_after_major + symbols_in_use + SYMBOL_SLACK;
+}
+
+/*
+ * Empty the nursery. If that leaves too little room in the old generation to
+ * be sure of being able to promote the next nursery-full, follow up with a
+ * major collection (or the end of the incremental one that is under way).
+ */
+static void collect()
+{
+    double start = now_seconds();
+    long long copied_before = bytes_copied();
+    long long majors_before = gc_stats.num_major_collections;
+
+    if (old_space_free() >= promotion_room()) {
+        collect_minor();
+    }
+    if (marking) {
+        if (old_space_free() < promotion_room() || mark_stack.size == 0) {
+            finish_marking();
+        }
+    } else if (old_space_free() < promotion_room() + evacuation_reserve()) {
+        collect_major();
+    } else if (pause_target > 0 && old_space_free() < free_after_major / 2) {
+        start_marking();
+    } else if (symbols_outgrown()) {
+        major_for_symbols = 1;
+        if (pause_target > 0) {
+            start_marking();
+        } else {
+            collect_major();
+        }
+    }
+
+    reset_alloc_limit();
+    record_pause(start,
+            (gc_stats.num_major_collections > majors_before)
+                ? PAUSE_MAJOR : PAUSE_MINOR,
+            copied_before);
+}
+
+void* lisp_alloc_old(size_t size)
+{
+    size = (size + GRANULE - 1) & ~(size_t)(GRANULE - 1);
+    // (leaving room to promote the nursery into, as a minor collection would)
+    if (old_space_free() < promotion_room() + evacuation_reserve() + size) {
+        collect();
+    }
+    void* result = old_alloc(size);
+    if (!result) {
+        fprintf(stderr, "gc: out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(result, 0, size);
+    if (conservative) {
+        note_old_start(result, size);
+    }
+    if (marking) {
+        mark_sized(result, size);
+        push_object(&self->promoted, result);
+    }
+    return result;
+}
+
+static size_t round_to_block(size_t size)
+{
+    return (size + BLOCK_SIZE - 1) & ~(size_t)(BLOCK_SIZE - 1);
+}
+
+// The free lines from byte from up to byte to of the old generation
+static size_t free_lines_between(size_t from, size_t to)
+{
+    size_t count = 0;
+    for (size_t line = from / LINE_SIZE; line < to / LINE_SIZE; line++) {
+        count += !line_used[line];
+    }
+    return count;
+}
+
+static void set_alloc_end(size_t end)
+{
+    if (end > alloc_end) {
+        free_lines += free_lines_between(alloc_end, end);
+    } else {
+        free_lines -= free_lines_between(end, alloc_end);
+    }
+    alloc_end = end;
+}
+
+/*
+ * Commit or release blocks at the end of the old generation so that it is
+ * new_size bytes, and allocate into all of it. Any blocks being released
+ * must be free.
+ */
+static void set_heap_size(size_t new_size)
+{
+    set_alloc_end(heap_size);
+    if (new_size > heap_size) {
+        if (mprotect(old_space + heap_size, new_size - heap_size,
+                    PROT_READ | PROT_WRITE) != 0) {
+            perror("gc: mprotect");
+            abort();
+        }
+        free_lines += (new_size - heap_size) / LINE_SIZE;
+    } else if (new_size < heap_size) {
+        madvise(old_space + new_size, heap_size - new_size, MADV_DONTNEED);
+        mprotect(old_space + new_size, heap_size - new_size, PROT_NONE);
+        free_lines -= (heap_size - new_size) / LINE_SIZE;
+    }
+    heap_size = alloc_end = new_size;
+}
+
+/*
+ * Aim to have the old generation no more than TARGET_SURVIVAL full after a
+ * major collection, and to spend no more than TARGET_GC_OVERHEAD of our time
+ * in major collections. Grow if we are missing either target, and shrink if
+ * we are well within both of them. (The time spent in minor collections
+ * depends on the size of the nursery, not the old generation, so it is left
+ * out.) Nothing has to be kept free for copying into, so the old generation
+ * can be kept much fuller than a semispace could.
+ */
+#define TARGET_SURVIVAL     0.8
+#define TARGET_GC_OVERHEAD  0.1
+
+static void resize_heap(size_t live, size_t used, double overhead)
+{
+    double survival = (double)live / (double)alloc_end;
+    size_t wanted = alloc_end;
+    if (survival > TARGET_SURVIVAL || overhead > TARGET_GC_OVERHEAD) {
+        wanted = live / TARGET_SURVIVAL;
+        if (overhead > TARGET_GC_OVERHEAD && wanted < alloc_end * 3 / 2) {
+            wanted = alloc_end * 3 / 2;
+        }
+    } else if (survival < TARGET_SURVIVAL / 4
+            && overhead < TARGET_GC_OVERHEAD / 2) {
+        wanted = alloc_end / 2;
+    }
+    // Always leave room to promote a full nursery, besides the lines in use
+    if (wanted < used + promotion_room() + wanted / 20) {
+        wanted = (used + promotion_room()) * 20 / 19;
+    }
+    wanted = round_to_block(wanted);
+    if (wanted < min_heap_size) wanted = min_heap_size;
+    if (wanted > max_heap_size) wanted = max_heap_size;
+    // Only free blocks off the end can be given back, so the ones in use past
+    // where we want to be have to be evacuated first. In the meantime, we
+    // stop allocating into them, if that still leaves room to collect in.
+    size_t end = wanted;
+    size_t last_used = heap_size / BLOCK_SIZE;
+    while (last_used > 0 && blocks[last_used - 1].used_lines == 0) {
+        last_used--;
+    }
+    if (wanted < last_used * BLOCK_SIZE) {
+        wanted = last_used * BLOCK_SIZE;
+        if (free_lines_between(0, end) * LINE_SIZE
+                < promotion_room() + end / 20) {
+            end = wanted;
+        }
+    }
+    if (end == alloc_end && wanted == heap_size) {
+        return;
+    }
+
+    size_t from = (end != alloc_end) ? alloc_end : heap_size;
+    size_t to = (end != alloc_end) ? end : wanted;
+    snprintf(last_resize, sizeof last_resize,
+            "%s from %zu to %zu bytes (survival %.2f, gc overhead %.1f%%)",
+            (to > from) ? "grew" : (to < wanted) ? "shrinking" : "shrank",
+            from, to, survival, 100.0 * overhead);
+    if (verbose_gc) {
+        fprintf(stderr, "gc: %s\n", last_resize);
+    }
+    if (to > from) {
+        gc_stats.num_heap_grows++;
+    } else {
+        gc_stats.num_heap_shrinks++;
+    }
+    if (wanted != heap_size) {
+        set_heap_size(wanted);
+    }
+    set_alloc_end(end);
+}
+
+/*
+ * Get ready for a major collection to mark from scratch
+ */
+static void clear_marks()
+{
+    memset(mark_bits, 0, heap_size / GRANULE / 8);
+    memset(immortal_marks, 0,
+            (immortal_free - immortal_space) / GRANULE / 8 + 1);
+    for (int i = 0; i < gc_threads; i++) {
+        gc_thread[i].live_bytes = 0;
+        gc_thread[i].evacuated_bytes = 0;
+    }
+}
+
+/*
+ * Pick the blocks that had the fewest live lines at the last sweep for their
+ * survivors to be copied out of, the emptiest first, after any in use past
+ * alloc_end. Each one needs room elsewhere for its live lines, and the lines
+ * free in it now can't be copied into either. We only take on as many as
+ * there is free space for, over and above what promoting a full nursery
+ * might need.
+ */
+static void choose_evacuation_candidates()
+{
+    size_t num_blocks = heap_size / BLOCK_SIZE;
+    size_t first_past = alloc_end / BLOCK_SIZE;
+    census.evacuated_blocks = 0;
+    for (size_t b = 0; b < num_blocks; b++) {
+        blocks[b].evacuate = 0;
+    }
+    size_t available = old_space_free();
+    if (available < promotion_room()) {
+        return;
+    }
+    available -= promotion_room();
+
+    size_t needed = 0;
+    for (size_t b = first_past; b < num_blocks; b++) {
+        size_t cost = (size_t)blocks[b].used_lines * LINE_SIZE;
+        if (cost > 0 && needed + cost <= available) {
+            needed += cost;
+            blocks[b].evacuate = 1;
+            census.evacuated_blocks++;
+        }
+    }
+
+    size_t cost[LINES_PER_BLOCK / 2 + 1] = {0};
+    for (size_t b = 0; b < first_past; b++) {
+        int live = blocks[b].used_lines;
+        if (live == 0 || live > LINES_PER_BLOCK / 2) {
+            continue;
+        }
+        int free_now = 0;
+        for (int i = 0; i < LINES_PER_BLOCK; i++) {
+            free_now += !line_used[b * LINES_PER_BLOCK + i];
+        }
+        cost[live] += (size_t)(live + free_now) * LINE_SIZE;
+    }
+    int threshold = 0;
+    for (int live = 1; live <= LINES_PER_BLOCK / 2; live++) {
+        if (needed + cost[live] > available) {
+            break;
+        }
+        needed += cost[live];
+        threshold = live;
+    }
+    for (size_t b = 0; b < first_past; b++) {
+        int live = blocks[b].used_lines;
+        blocks[b].evacuate = (live > 0 && live <= threshold);
+        census.evacuated_blocks += blocks[b].evacuate;
+    }
+}
+
+/*
+ * Marking is over, so whatever lines weren't marked are free
+ */
+static void sweep()
+{
+    size_t num_blocks = heap_size / BLOCK_SIZE;
+    census.free_blocks = census.recyclable_blocks = census.full_blocks = 0;
+    census.hole_bytes = census.used_bytes = 0;
+    free_lines = 0;
+    for (size_t b = 0; b < num_blocks; b++) {
+        int used = 0;
+        for (int i = 0; i < LINES_PER_BLOCK; i++) {
+            used += line_live[b * LINES_PER_BLOCK + i];
+        }
+        blocks[b].used_lines = used;
+        blocks[b].evacuate = 0;
+        blocks[b].free_sweeps = (used == 0) ? blocks[b].free_sweeps + 1 : 0;
+        if (used == 0) {
+            census.free_blocks++;
+        } else if (used == LINES_PER_BLOCK) {
+            census.full_blocks++;
+        } else {
+            census.recyclable_blocks++;
+            census.hole_bytes += (LINES_PER_BLOCK - used) * LINE_SIZE;
+        }
+        census.used_bytes += (size_t)used * LINE_SIZE;
+        if (b < alloc_end / BLOCK_SIZE) {
+            free_lines += LINES_PER_BLOCK - used;
+        }
+    }
+    if (conservative) {
+        // Only the objects that were marked are still there
+        for (size_t i = 0; i < heap_size / GRANULE / 8; i++) {
+            old_starts[i] &= mark_bits[i];
+        }
+        // and a page is in use if one starts in it, or just before it
+        size_t per_page = PAGE_BYTES / GRANULE / 8;
+        for (size_t page = 0; page < heap_size / PAGE_BYTES; page++) {
+            unsigned char* starts = old_starts + page * per_page;
+            unsigned char any = (page > 0) ? starts[-1] : 0;
+            for (size_t i = 0; i < per_page; i++) {
+                any |= starts[i];
+            }
+            if (any) {
+                old_pages[page / 8] |= 1 << (page % 8);
+            } else {
+                old_pages[page / 8] &= ~(1 << (page % 8));
+            }
+        }
+    }
+    unsigned char* swap = line_used;
+    line_used = line_live;
+    line_live = swap;
+    memset(line_live, 0, heap_size / LINE_SIZE);
+    reset_holes();
+
+    census.live_bytes = 0;
+    for (int i = 0; i < gc_threads; i++) {
+        census.live_bytes += gc_thread[i].live_bytes;
+    }
+}
+
+/*
+ * Memory
+ *
+ * Blocks that have been free for two major collections running, without
+ * being allocated into in between, are more than the program needs just now,
+ * so their pages are handed back with MADV_DONTNEED. So are free blocks past
+ * alloc_end, as soon as they are free, since they won't be allocated into.
+ * They stay committed, and come back zeroed if they are used again. Once the
+ * old generation is large, it and the nursery ask for transparent huge pages
+ * to save on TLB misses. Pages are then only released in whole huge pages, so
+ * as not to break them up (except past alloc_end).
+ */
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+#define HUGE_PAGE_HEAP  (64 * 1024 * 1024) // ask for huge pages past this
+
+static int huge_pages;
+
+static void use_huge_pages()
+{
+#ifdef MADV_HUGEPAGE
+    if (!huge_pages && heap_size >= HUGE_PAGE_HEAP) {
+        madvise(old_space, max_heap_size, MADV_HUGEPAGE);
+        madvise(nursery, nursery_size, MADV_HUGEPAGE);
+        huge_pages = 1;
+    }
+#endif
+}
+
+static int is_idle(size_t block)
+{
+    if (blocks[block].released) {
+        return 0;
+    }
+    if (block >= alloc_end / BLOCK_SIZE) {
+        return blocks[block].used_lines == 0;
+    }
+    return blocks[block].free_sweeps >= 2;
+}
+
+// Release the blocks from first up to end, or whatever whole pages of them.
+// (Huge pages past alloc_end may as well be broken up.)
+static void release_blocks(size_t first, size_t end)
+{
+    size_t page = (huge_pages && first < alloc_end / BLOCK_SIZE)
+        ? HUGE_PAGE_SIZE : (size_t)getpagesize();
+    size_t from = ((size_t)(old_space + first * BLOCK_SIZE) + page - 1)
+        & ~(page - 1);
+    size_t to = (size_t)(old_space + end * BLOCK_SIZE) & ~(page - 1);
+    if (from >= to) {
+        return;
+    }
+    madvise((void*)from, to - from, MADV_DONTNEED);
+    gc_stats.total_bytes_released += to - from;
+    for (size_t b = ((void*)from - old_space) / BLOCK_SIZE;
+            b < ((void*)to - old_space) / BLOCK_SIZE; b++) {
+        blocks[b].released = 1;
+    }
+}
+
+static void release_idle_blocks()
+{
+    size_t num_blocks = heap_size / BLOCK_SIZE;
+    size_t b = 0;
+    while (b < num_blocks) {
+        if (!is_idle(b)) {
+            b++;
+            continue;
+        }
+        size_t end = b;
+        while (end < num_blocks && is_idle(end)) {
+            end++;
+        }
+        release_blocks(b, end);
+        b = end;
+    }
+}
+
+// The resident set size in bytes, or 0 if we can't tell
+static size_t resident_bytes()
+{
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return (size_t)pages * getpagesize();
+}
+
+/*
+ * The end of every major collection, incremental or not. The last pause took
+ * pause_seconds, out of seconds spent on the collection altogether.
+ */
+static void finish_major(double pause_seconds, double seconds)
+{
+    double start = now_seconds();
+
+    size_t used_before = heap_size - old_space_free()
+        - free_lines_between(alloc_end, heap_size) * LINE_SIZE;
+    rss_before_major = resident_bytes();
+    reset_nursery();
+    sweep();
+
+    // The names being read by the reader are still wanted too
+    for (tagged_stype* p = reader_stack; p < rs_ptr; p++) {
+        if (p->tag == VAR) {
+            sym_mark(p->sval.id);
+        }
+    }
+    symbols_in_use = sym_reclaim();
+    symbols_after_major = sym_count();
+
+    if (verbose_gc) {
+        fprintf(stderr, "gc: major collection finished\n");
+        fprintf(stderr, "%.2f old generation used\n", pct_old_full());
+        fprintf(stderr, "gc: %zu symbols\n", sym_count());
+    }
+    gc_stats.num_collections++;
+    gc_stats.num_major_collections++;
+    size_t live = census.used_bytes;
+    if (used_before > 0) {
+        last_old_survival = (double)live / used_before;
+    }
+    gc_stats.total_bytes_retained += live;
+
+    double end = now_seconds();
+    pause_seconds += end - start;
+    seconds += end - start;
+    gc_stats.total_gc_seconds += pause_seconds;
+    double overhead = seconds / (end - last_major_end);
+    // (a bigger heap wouldn't have put off one that was for the symbols)
+    if (major_for_symbols) {
+        overhead = 0;
+        major_for_symbols = 0;
+    }
+    resize_heap(census.live_bytes, live, overhead);
+    use_huge_pages();
+    release_idle_blocks();
+    rss_after_major = resident_bytes();
+    last_major_end = now_seconds();
+    free_after_major = old_space_free();
+
+    if (old_space_free() < promotion_room()) {
+        fprintf(stderr, "gc: out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Mark everything that is live, in the nursery or the old generation,
+ * promoting the survivors in the nursery and evacuating the survivors in the
+ * most fragmented blocks as we go
+ */
+static void collect_major()
+{
+    if (verbose_gc)
+        fprintf(stderr, "performing major collection\n");
+
+    double start = now_seconds();
+
+    clear_marks();
+    reset_holes();
+    choose_evacuation_candidates();
+
+    // Everything young is reachable from the roots or from some live old
+    // object, so the remembered set is no longer needed
+    remembered_set.size = 0;
+
+    tracing_old = 1;
+    grey_immortal_set();
+    visit_roots(gather_root);
+    trace_in_parallel();
+    process_weak();
+    tracing_old = 0;
+
+    double elapsed = now_seconds() - start;
+    finish_major(elapsed, elapsed);
+}
+
+/*
+ * Begin an incremental major collection by marking what the roots point at.
+ * The rest is found by scanning a step at a time.
+ */
+static void start_marking()
+{
+    if (verbose_gc)
+        fprintf(stderr, "starting incremental major collection\n");
+
+    double start = now_seconds();
+
+    clear_marks();
+    // (anything left over from the last cycle may since have been swept)
+    mark_stack.size = 0;
+    marking = 1;
+    for (int i = 0; i < immortal_set.size; i++) {
+        visit_fields(immortal_set.data[i], shade);
+    }
+    visit_roots(shade);
+
+    cycle_seconds = now_seconds() - start;
+    gc_stats.total_gc_seconds += cycle_seconds;
+}
+
+/*
+ * Scan marked objects until we run out of them or reach the deadline
+ */
+static void mark_some(double deadline)
+{
+    while (mark_stack.size > 0) {
+        // (only look at the clock every so often)
+        for (int i = 0; i < 64 && mark_stack.size > 0; i++) {
+            LispVal* obj = mark_stack.data[--mark_stack.size];
+            note_symbol(obj);
+            visit_fields(obj, shade);
+        }
+        if (now_seconds() > deadline) {
+            break;
+        }
+    }
+}
+
+/*
+ * One increment of work, done from lisp_alloc every step_bytes of
+ * allocation or from mark_safepoint. Once there is nothing left to mark,
+ * the next step finishes the collection off instead.
+ */
+static void incremental_step()
+{
+    if (!marking) {
+        reset_alloc_limit();
+        return;
+    }
+    if (mark_stack.size == 0) {
+        collect();
+        return;
+    }
+    double start = now_seconds();
+    mark_some(start + pause_target);
+
+    double elapsed = now_seconds() - start;
+    gc_stats.num_incremental_steps++;
+    gc_stats.total_gc_seconds += elapsed;
+    cycle_seconds += elapsed;
+    record_pause(start, PAUSE_STEP, bytes_copied());
+
+    reset_alloc_limit();
+}
+
+/*
+ * The final pause of an incremental major collection. The roots are traced
+ * again, along with whatever is still in the nursery and anything left to
+ * mark, and then we can sweep.
+ */
+static void finish_marking()
+{
+    if (verbose_gc)
+        fprintf(stderr, "finishing incremental major collection\n");
+
+    double start = now_seconds();
+
+    for (int i = 0; i < mark_stack.size; i++) {
+        deque_push(&gc_thread[0].grey, mark_stack.data[i]);
+    }
+    mark_stack.size = 0;
+    // Objects allocated old since the last minor collection have been marked
+    // but not scanned. The lists are emptied now, so that none of them are
+    // left to be scanned in the next cycle, after they may have been swept.
+    for (int i = 0; i < gc_threads; i++) {
+        struct ObjectList* promoted = &gc_thread[i].promoted;
+        for (int j = 0; j < promoted->size; j++) {
+            deque_push(&gc_thread[0].grey, promoted->data[j]);
+        }
+        promoted->size = 0;
+    }
+
+    tracing_old = 1;
+    for (int i = 0; i < remembered_set.size; i++) {
+        deque_push(&gc_thread[0].grey, remembered_set.data[i]);
+    }
+    remembered_set.size = 0;
+    grey_immortal_set();
+    visit_roots(gather_root);
+    trace_in_parallel();
+    process_weak();
+    tracing_old = 0;
+    marking = 0;
+
+    double elapsed = now_seconds() - start;
+    finish_major(elapsed, cycle_seconds + elapsed);
+}
+
+void gc_set_conservative(void* base)
+{
+    conservative = 1;
+    stack_base = base;
+#ifdef __x86_64__
+    use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+void gc_set_threads(int n)
+{
+    gc_threads = (n > 1) ? n : 1;
+}
+
+void gc_set_pause_target(double seconds)
+{
+    pause_target = seconds;
+}
+
+static void* map_table(size_t size)
+{
+    void* table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) { perror("gc: mmap"); abort(); }
+    return table;
+}
+
+void initialize_heap(size_t min_size, size_t max_size)
+{
+    if (max_size < min_size) {
+        max_size = min_size;
+    }
+    min_heap_size = round_to_block(min_size);
+    max_heap_size = round_to_block(max_size);
+    nursery_size = min_heap_size / 4;
+    nursery_space = nursery_size;
+    // Pinned objects can't be promoted, so a conservative nursery may grow
+    // as the heap does, to a quarter of the most it may be
+    if (conservative) {
+        nursery_space = nursery_size * NURSERY_GROWTH;
+        if (nursery_space < max_heap_size / 4) {
+            nursery_space = max_heap_size / 4;
+        }
+    }
+    nursery_space = round_to_block(nursery_space);
+#ifdef COMPRESSED_REFS
+    // Everything must be within 4GB of lisp_heap_base
+    size_t max_space = ((size_t)1 << 32) - 2 * BLOCK_SIZE
+        - IMMORTAL_SPACE_SIZE - nursery_space;
+    if (max_heap_size > max_space) {
+        max_heap_size = max_space;
+    }
+    if (min_heap_size > max_heap_size) {
+        min_heap_size = max_heap_size;
+    }
+#endif
+
+    /*
+     * The immortal space, the nursery and the old generation share one
+     * reservation. It starts with an unused block, so that no object is at
+     * offset 0 from lisp_heap_base, and has an extra block so that we can
+     * start on a block boundary.
+     */
+    void* reservation = mmap(NULL, 2 * BLOCK_SIZE + IMMORTAL_SPACE_SIZE
+            + nursery_space + max_heap_size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED) { perror("gc: mmap"); abort(); }
+    lisp_heap_base = (void*)round_to_block((size_t)reservation);
+    immortal_space = immortal_free = immortal_limit =
+        lisp_heap_base + BLOCK_SIZE;
+    nursery = immortal_space + IMMORTAL_SPACE_SIZE;
+    if (mprotect(nursery, nursery_size, PROT_READ | PROT_WRITE) != 0) {
+        perror("gc: mprotect");
+        abort();
+    }
+    old_space = nursery + nursery_space;
+
+    immortal_remembered = map_table(IMMORTAL_SPACE_SIZE / GRANULE / 8);
+    immortal_marks = map_table(IMMORTAL_SPACE_SIZE / GRANULE / 8);
+    line_used = map_table(max_heap_size / LINE_SIZE);
+    line_live = map_table(max_heap_size / LINE_SIZE);
+    mark_bits = map_table(max_heap_size / GRANULE / 8);
+    blocks = map_table(max_heap_size / BLOCK_SIZE * sizeof *blocks);
+    if (conservative) {
+        nursery_starts = map_table(nursery_space / GRANULE / 8 + 1);
+        pinned_bits = map_table(nursery_space / GRANULE / 8 + 1);
+        pinned_scanned = map_table(nursery_space / GRANULE / 8 + 1);
+        old_starts = map_table(max_heap_size / GRANULE / 8);
+        old_pages = map_table(max_heap_size / PAGE_BYTES / 8 + 1);
+    }
+
+    heap_size = 0;
+    set_heap_size(min_heap_size);
+    use_huge_pages();
+    free_after_major = old_space_free();
+
+    gc_free_ptr = nursery;
+    gc_alloc_limit = nursery + nursery_size;
+    step_bytes = nursery_size / 16;
+    if (alloc_profiling) {
+        next_sample = nursery + profile_next_interval();
+        update_alloc_limit();
+    }
+
+    gc_grow_root_stack();
+    start_gc_threads();
+
+    last_major_end = heap_start_time = now_seconds();
+}
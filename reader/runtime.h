@@ -2,18 +2,211 @@
 #define __RUNTIME__AST_H__
 
 #include <stdlib.h>
+#include "ast.h"
 
-void* lisp_alloc(size_t size);
+/*
+ * Allocation is a pointer bump in the nursery, and the memory comes already
+ * zeroed. Only when the nursery is full, or an incremental collection step is
+ * due, do we go out of line.
+ */
+extern void* gc_free_ptr;
+extern void* gc_alloc_limit;
+
+void* lisp_alloc_slow(size_t size);
+
+/*
+ * Or allocate a boxed object straight into the old generation, where a minor
+ * collection won't move it. Like the nursery, this may collect first.
+ */
+void* lisp_alloc_old(size_t size);
 
-void initialize_heap(size_t initial_heap_size);
+static inline void* lisp_alloc(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    void* result = gc_free_ptr;
+    if (__builtin_expect(result + size <= gc_alloc_limit, 1)) {
+        gc_free_ptr = result + size;
+        return result;
+    }
+    return lisp_alloc_slow(size);
+}
+
+/*
+ * Precise roots
+ *
+ * The collector moves objects, so any LispVal* held in a C variable across a
+ * call that might allocate has to be registered with it, so that it can be
+ * found and updated:
+ *
+ *     LispVal* tmp = NULL;
+ *     GC_PROTECT(&expr, &env, &tmp);
+ *
+ * The slots are pushed onto a shadow stack and popped again automatically
+ * when the enclosing block is left. A block can only have one GC_PROTECT, so
+ * declare everything that needs protecting up front (NULL is fine).
+ */
+extern LispVal*** gc_root_stack;
+extern LispVal*** gc_root_sp;
+extern LispVal*** gc_root_limit;
+
+void gc_grow_root_stack();
+
+static inline void gc_push_roots(LispVal** slots[], int n)
+{
+    while (gc_root_sp + n > gc_root_limit) {
+        gc_grow_root_stack();
+    }
+    for (int i = 0; i < n; i++) {
+        *gc_root_sp++ = slots[i];
+    }
+}
+
+// (the shadow stack may be reallocated as it grows, so scopes remember a
+// depth rather than a pointer into it)
+static inline void gc_pop_roots(size_t* saved_depth)
+{
+    gc_root_sp = gc_root_stack + *saved_depth;
+}
+
+#define GC_PROTECT(...) \
+    size_t gc_scope__ __attribute__((cleanup(gc_pop_roots))) = \
+        gc_root_sp - gc_root_stack; \
+    gc_push_roots((LispVal**[]){ __VA_ARGS__ }, \
+            sizeof((LispVal**[]){ __VA_ARGS__ }) / sizeof(LispVal**))
+
+/*
+ * Global variables that hold LispVal*s are registered once, and are then
+ * treated as roots by every collection
+ */
+void gc_add_root(LispVal** slot);
+
+/*
+ * An array used as a stack of LispVal*s. Only the live part, from start up
+ * to wherever *top currently points, is treated as roots.
+ */
+void gc_add_root_stack(LispVal** start, LispVal*** top);
+
+/*
+ * Must be called after storing value into a field of obj. If obj has already
+ * been promoted to the old generation, the collector needs to know it might
+ * now be pointing into the nursery.
+ */
+void gc_write_barrier(LispVal* obj, LispVal* value);
+
+/*
+ * While on is set, allocate into the immortal space instead of the nursery.
+ * Objects there are never collected, so this is for what will be needed for
+ * as long as the program runs.
+ */
+void gc_set_immortal(int on);
+int gc_is_immortal(LispVal* obj);
+
+/*
+ * The old generation starts out at min_size and is grown or shrunk between
+ * min_size and max_size depending on how much survives each major collection
+ * and how much time is being spent collecting. Neither should be less than
+ * GC_MIN_HEAP_SIZE.
+ */
+#define GC_MIN_HEAP_SIZE (64 * 1024)
+void initialize_heap(size_t min_size, size_t max_size);
+
+/*
+ * Share the copying in stop-the-world collections between n threads
+ */
+void gc_set_threads(int n);
+
+/*
+ * Aim to keep each collector pause under this many seconds by doing major
+ * collections incrementally. 0 (the default) collects all in one go.
+ */
+void gc_set_pause_target(double seconds);
+
+/*
+ * Treat anything on the C stack, between here and stack_base, that looks like
+ * a reference as one, and keep what it points at where it is. Must be called
+ * before initialize_heap.
+ */
+void gc_set_conservative(void* stack_base);
+
+/*
+ * Weak boxes and ephemerons (see ast.c) are registered as they are made, so
+ * that collections can drop what they refer to once it's otherwise gone
+ */
+void gc_register_weak(LispVal* obj);
+
+/*
+ * Call release(data) once obj has been collected. It's called by the
+ * collection that finds obj gone, so it mustn't touch the heap.
+ */
+void gc_add_finalizer(LispVal* obj, void (*release)(void*), void* data);
+
+/*
+ * Or queue thunk, a procedure of no arguments, to be called once obj has been
+ * collected. (If thunk refers to obj, obj can never be collected.) The thunks
+ * that are due are taken one at a time with gc_next_finalizer, which returns
+ * NULL once there are none left.
+ */
+void gc_add_finalizer_thunk(LispVal* obj, LispVal* thunk);
+LispVal* gc_next_finalizer();
 
 /*
  * Mark a line in the sand for the collector that things allocated after this
- * point may not be visible to it
+ * point may not be visible to it. Collects if the nursery is getting full, so
+ * it should only be called where everything live is reachable from roots.
  */
 void mark_safepoint();
 
+/*
+ * Anything worked out from the addresses of objects is stale once they have
+ * moved. Young objects can move in any collection, but old ones only in major
+ * collections, so gc_moves(1) counts all the collections there have been and
+ * gc_moves(0) just the major ones.
+ */
+long long gc_moves(int young);
+int gc_is_young(LispVal* obj);
+
 // Just to get a print of GC stats
 void print_heap_state();
 
+/*
+ * A summary of how the collector has behaved so far. Pause times are in
+ * seconds, survival ratios are fractions and mmu[i] is the minimum mutator
+ * utilisation over windows of gc_mmu_windows[i] seconds.
+ */
+#define GC_MMU_WINDOWS 4
+extern const double gc_mmu_windows[GC_MMU_WINDOWS];
+
+struct GCReport {
+    long long collections;
+    long long major_collections;
+    long long pauses;
+    long long bytes_allocated;
+    long long bytes_promoted;
+    long long bytes_evacuated;
+    size_t heap_size;
+    size_t immortal_size;
+    size_t rss; // resident set size, 0 if unknown
+    size_t rss_before_major; // either side of the last major collection
+    size_t rss_after_major;
+    long long bytes_released; // idle pages handed back to the system
+    double elapsed_seconds;
+    double gc_seconds;
+    double pause_p50;
+    double pause_p99;
+    double pause_max;
+    double allocation_rate; // bytes per second
+    double nursery_survival; // promoted out of allocated
+    double old_survival; // live out of used, in the last major collection
+    double throughput; // fraction of the time spent outside the collector
+    double mmu[GC_MMU_WINDOWS];
+};
+
+void gc_report(struct GCReport* report);
+
+/*
+ * Write the report, and a log of recent pauses, as JSON to path when the
+ * program exits. "-" means stderr.
+ */
+void gc_write_stats_at_exit(const char* path);
+
 #endif /* __RUNTIME__AST_H__ */
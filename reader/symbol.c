@@ -1,39 +1,343 @@
 #include "symbol.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <pthread.h>
 
-static Symbol* symbol_table = NULL;
-static int symbol_table_size = 0;
-static int sym_table_count = 0;
+/*
+ * Symbols are interned in an open addressing hash table. Each slot keeps the
+ * name's hash and length alongside it, so a probe only compares names that
+ * are likely to match. Names are copied into an arena of chunks.
+ *
+ * Looking a symbol up takes no lock: the table in use and the names in its
+ * slots are published with release stores, and a slot's hash and length are
+ * written before its name. Adding a symbol, or growing the table, is done
+ * under intern_lock.
+ *
+ * Symbols are reclaimed by major collections (see sym_reclaim). A name in the
+ * arena has a small header saying whether the collection found it in use,
+ * and whether it has been looked up since the last reclaim, in case the
+ * caller has yet to make an atom of it. A lookup that finds a name without
+ * the lock checks that no reclaim began before it touched it, or it might
+ * return a name that the reclaim has just dropped; if one did, it looks
+ * again under the lock.
+ */
+struct Slot {
+    const char* name; // NULL while the slot is free
+    size_t hash;
+    size_t length;
+};
 
-Symbol sym(const char* name)
+struct Table {
+    size_t size; // a power of 2
+    size_t count;
+    struct Table* older; // retired, to be freed by the next reclaim
+    struct Slot slots[];
+};
+
+struct Chunk {
+    struct Chunk* next;
+    char* end;
+    size_t live; // names in it that were kept by the last reclaim
+    char data[];
+};
+
+struct Name {
+    struct Chunk* chunk;
+    unsigned char marked; // by the collector
+    unsigned char touched; // looked up since the last reclaim
+    unsigned char permanent;
+    unsigned char id; // given by sym_set_id
+    char text[];
+};
+
+static struct Table* symbol_table = NULL;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long reclaims; // odd while one is under way
+static int lookups; // under way without the lock
+
+#define ARENA_CHUNK (64 * 1024)
+static struct Chunk* chunks; // the first is the one being filled
+static struct Chunk* retired_chunks; // to be freed by the next reclaim
+static char* arena_ptr;
+
+static struct Name* name_of(const char* text)
 {
-    if (sym_table_count >= symbol_table_size) {
-        int new_table_size = symbol_table_size ? 2 * symbol_table_size : 1024;
-        Symbol* new_table =
-            malloc(new_table_size * sizeof *symbol_table);
-        if (!new_table) {
+    return (struct Name*)(text - offsetof(struct Name, text));
+}
+
+static size_t hash_name(const char* name, size_t length)
+{
+    // FNV-1a
+    size_t hash = (size_t)14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * (size_t)1099511628211ULL;
+    }
+    return hash;
+}
+
+static const char* arena_copy(const char* name, size_t length)
+{
+    // (keeping each header aligned)
+    size_t size = (sizeof(struct Name) + length + 1 + 7) & ~(size_t)7;
+    if (!chunks || (size_t)(chunks->end - arena_ptr) < size) {
+        size_t data = (size > ARENA_CHUNK) ? size : ARENA_CHUNK;
+        struct Chunk* chunk = malloc(sizeof *chunk + data);
+        if (!chunk) {
             perror("out of memory");
             abort();
         }
-        if (symbol_table_size) {
-            memcpy(new_table, symbol_table, symbol_table_size * sizeof *symbol_table);
+        chunk->next = chunks;
+        chunk->end = chunk->data + data;
+        chunk->live = 0;
+        chunks = chunk;
+        arena_ptr = chunk->data;
+    }
+    struct Name* entry = (struct Name*)arena_ptr;
+    arena_ptr += size;
+    entry->chunk = chunks;
+    entry->marked = 0;
+    entry->touched = 1;
+    entry->permanent = 0;
+    entry->id = 0;
+    memcpy(entry->text, name, length);
+    entry->text[length] = '\0';
+    return entry->text;
+}
+
+static struct Table* new_table(size_t size, struct Table* older)
+{
+    struct Table* table = calloc(1, sizeof *table + size * sizeof(struct Slot));
+    if (!table) {
+        perror("out of memory");
+        abort();
+    }
+    table->size = size;
+    table->older = older;
+    return table;
+}
+
+static void insert_slot(struct Table* table, struct Slot* slot)
+{
+    size_t j = slot->hash & (table->size - 1);
+    while (table->slots[j].name) {
+        j = (j + 1) & (table->size - 1);
+    }
+    table->slots[j] = *slot;
+    table->count++;
+}
+
+static const char* probe(struct Table* table, const char* name, size_t length,
+        size_t hash, size_t* free_slot)
+{
+    size_t mask = table->size - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct Slot* slot = &table->slots[i];
+        const char* found = __atomic_load_n(&slot->name, __ATOMIC_ACQUIRE);
+        if (!found) {
+            *free_slot = i;
+            return NULL;
+        }
+        if (slot->hash == hash && slot->length == length
+                && memcmp(found, name, length) == 0) {
+            return found;
         }
-        free(symbol_table);
-        symbol_table = new_table;
-        symbol_table_size = new_table_size;
     }
-    for (int i = 0; i < sym_table_count; i++) {
-        if (name == symbol_table[i].name)
-            return symbol_table[i];
-        if (strcmp(name, symbol_table[i].name) == 0) {
-            return symbol_table[i];
+}
+
+static void grow_table()
+{
+    size_t size = symbol_table ? 2 * symbol_table->size : 1024;
+    struct Table* table = new_table(size, symbol_table);
+    if (symbol_table) {
+        for (size_t i = 0; i < symbol_table->size; i++) {
+            if (symbol_table->slots[i].name) {
+                insert_slot(table, &symbol_table->slots[i]);
+            }
         }
     }
-    return symbol_table[sym_table_count++] = (Symbol){
-        .name = strdup(name)
-    };
+    __atomic_store_n(&symbol_table, table, __ATOMIC_RELEASE);
+}
+
+static Symbol touch(const char* found)
+{
+    struct Name* entry = name_of(found);
+    if (!__atomic_load_n(&entry->touched, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&entry->touched, 1, __ATOMIC_SEQ_CST);
+    }
+    return (Symbol){ .name = found };
 }
 
+Symbol sym(const char* name)
+{
+    size_t length = strlen(name);
+    size_t hash = hash_name(name, length);
+    size_t free_slot;
+
+    Symbol symbol = { NULL };
+    __atomic_fetch_add(&lookups, 1, __ATOMIC_SEQ_CST);
+    unsigned long reclaim = __atomic_load_n(&reclaims, __ATOMIC_SEQ_CST);
+    struct Table* table = __atomic_load_n(&symbol_table, __ATOMIC_ACQUIRE);
+    if (table && !(reclaim & 1)) {
+        const char* found = probe(table, name, length, hash, &free_slot);
+        if (found) {
+            symbol = touch(found);
+            if (__atomic_load_n(&reclaims, __ATOMIC_SEQ_CST) != reclaim) {
+                symbol.name = NULL;
+            }
+        }
+    }
+    __atomic_fetch_sub(&lookups, 1, __ATOMIC_RELEASE);
+    if (symbol.name) {
+        return symbol;
+    }
 
+    pthread_mutex_lock(&intern_lock);
+    // (it might have been added, or the table grown, since we looked)
+    if (!symbol_table || 2 * (symbol_table->count + 1) > symbol_table->size) {
+        grow_table();
+    }
+    table = symbol_table;
+    const char* found = probe(table, name, length, hash, &free_slot);
+    if (found) {
+        symbol = touch(found);
+        pthread_mutex_unlock(&intern_lock);
+        return symbol;
+    }
+    struct Slot* slot = &table->slots[free_slot];
+    slot->hash = hash;
+    slot->length = length;
+    found = arena_copy(name, length);
+    __atomic_store_n(&slot->name, found, __ATOMIC_RELEASE);
+    table->count++;
+    pthread_mutex_unlock(&intern_lock);
+    return (Symbol){ .name = found };
+}
+
+Symbol sym_permanent(const char* name)
+{
+    Symbol symbol = sym(name);
+    sym_keep(symbol);
+    return symbol;
+}
+
+void sym_keep(Symbol symbol)
+{
+    name_of(symbol.name)->permanent = 1;
+}
+
+void sym_set_id(Symbol symbol, int id)
+{
+    struct Name* entry = name_of(symbol.name);
+    entry->permanent = 1;
+    entry->id = id;
+}
+
+int sym_id(Symbol symbol)
+{
+    return name_of(symbol.name)->id;
+}
+
+void sym_mark(Symbol symbol)
+{
+    struct Name* entry = name_of(symbol.name);
+    if (!__atomic_load_n(&entry->marked, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&entry->marked, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Drop the symbols that weren't marked, touched or kept, into a table sized
+ * for what's left, and free any chunk of the arena left with no names in it.
+ * The old tables and chunks are freed by a later reclaim, one that finds no
+ * other thread in the middle of looking in them. Whether a name is kept is
+ * decided once, in the first pass, and noted in its marked flag.
+ */
+size_t sym_reclaim()
+{
+    pthread_mutex_lock(&intern_lock);
+    if (!symbol_table) {
+        pthread_mutex_unlock(&intern_lock);
+        return 0;
+    }
+    // (a lookup starting from here on can only see symbol_table)
+    if (__atomic_load_n(&lookups, __ATOMIC_SEQ_CST) == 0) {
+        for (struct Table* t = symbol_table->older; t;) {
+            struct Table* older = t->older;
+            free(t);
+            t = older;
+        }
+        symbol_table->older = NULL;
+        while (retired_chunks) {
+            struct Chunk* next = retired_chunks->next;
+            free(retired_chunks);
+            retired_chunks = next;
+        }
+    }
+
+    // (a lookup that touches a name from here on will look again)
+    __atomic_fetch_add(&reclaims, 1, __ATOMIC_SEQ_CST);
+    size_t kept = 0;
+    size_t in_use = 0;
+    for (struct Chunk* c = chunks; c; c = c->next) {
+        c->live = 0;
+    }
+    for (size_t i = 0; i < symbol_table->size; i++) {
+        const char* name = symbol_table->slots[i].name;
+        if (!name) {
+            continue;
+        }
+        struct Name* entry = name_of(name);
+        if (__atomic_load_n(&entry->marked, __ATOMIC_RELAXED)
+                || entry->permanent) {
+            in_use++;
+        } else if (!__atomic_load_n(&entry->touched, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        entry->marked = 1;
+        entry->chunk->live++;
+        kept++;
+    }
+
+    size_t size = 1024;
+    while (size < 4 * kept) {
+        size *= 2;
+    }
+    struct Table* table = new_table(size, symbol_table);
+    for (size_t i = 0; i < symbol_table->size; i++) {
+        struct Slot* slot = &symbol_table->slots[i];
+        if (!slot->name) {
+            continue;
+        }
+        struct Name* entry = name_of(slot->name);
+        if (entry->marked) {
+            entry->marked = 0;
+            __atomic_store_n(&entry->touched, 0, __ATOMIC_RELAXED);
+            insert_slot(table, slot);
+        }
+    }
+    __atomic_store_n(&symbol_table, table, __ATOMIC_RELEASE);
+
+    // (the chunk being filled is kept regardless)
+    for (struct Chunk** c = &chunks->next; *c;) {
+        if ((*c)->live == 0) {
+            struct Chunk* dead = *c;
+            *c = dead->next;
+            dead->next = retired_chunks;
+            retired_chunks = dead;
+        } else {
+            c = &(*c)->next;
+        }
+    }
+    __atomic_fetch_add(&reclaims, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&intern_lock);
+    return in_use;
+}
+
+size_t sym_count()
+{
+    struct Table* table = __atomic_load_n(&symbol_table, __ATOMIC_ACQUIRE);
+    return table ? table->count : 0;
+}
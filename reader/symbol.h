@@ -1,12 +1,35 @@
 #ifndef __SS__SYMBOL_H__
 #define __SS__SYMBOL_H__
 
+#include <stddef.h>
+
 typedef struct Symbol {
     const char* name;
 } Symbol;
 
 Symbol sym(const char* name);
 
+/*
+ * Symbols not in use are dropped from the table by sym_reclaim. One is in use
+ * if it was marked by the collector, looked up since the last reclaim, or
+ * kept. A Symbol held in a C variable across collections has to be kept.
+ * sym_reclaim returns how many of those left were marked or kept, i.e. not
+ * just looked up.
+ */
+Symbol sym_permanent(const char* name);
+void sym_keep(Symbol symbol);
+void sym_mark(Symbol symbol);
+size_t sym_reclaim();
+size_t sym_count();
+
+/*
+ * A small number (up to 255) can be given to a symbol, which keeps it, so
+ * that a caller can switch on the symbols it's interested in. Symbols not
+ * given one have 0.
+ */
+void sym_set_id(Symbol symbol, int id);
+int sym_id(Symbol symbol);
+
 static inline const char* symtext(const Symbol symbol)
 {
     return symbol.name;
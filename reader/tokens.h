@@ -17,6 +17,7 @@ union yystype {
     LispVal* value;
     // Terminals
     Symbol id;
+    int number;
     int token;
     char err_char;
 } yylval;